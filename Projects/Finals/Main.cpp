@@ -6,10 +6,53 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <numeric>
+#include <cfloat>
+#include <limits>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <bitset>
+#include <charconv>
+#include <string_view>
+#include <unordered_map>
+#include <cctype>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <math.h>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RT_TARGET_AVX2
+#else
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
@@ -19,6 +62,177 @@ struct Ray
     glm::vec3 direction; // Ray direction
 };
 
+// Axis-aligned bounding box
+struct AABB
+{
+    glm::vec3 min; // Minimum corner
+    glm::vec3 max; // Maximum corner
+
+    /**
+     * @brief Constructor. Creates an empty (inverted) box that any call to Grow() will replace.
+     */
+    AABB()
+        : min(FLT_MAX), max(-FLT_MAX)
+    {
+    }
+
+    /**
+     * @brief Expands the box so that it contains the provided point
+     * @param[in] p Point to include
+     */
+    void Grow(const glm::vec3 &p)
+    {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    /**
+     * @brief Expands the box so that it contains the provided box
+     * @param[in] b Box to include
+     */
+    void Grow(const AABB &b)
+    {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+
+    /**
+     * @brief Center point of the box
+     */
+    glm::vec3 Centroid() const
+    {
+        return (min + max) * 0.5f;
+    }
+
+    /**
+     * @brief Surface area of the box, used by the SAH cost. Empty boxes have an area of 0.
+     */
+    float SurfaceArea() const
+    {
+        glm::vec3 e = max - min;
+        if (e.x < 0 || e.y < 0 || e.z < 0)
+        {
+            return 0.0f;
+        }
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    /**
+     * @brief Ray-box slab test
+     * @param[in] origin    Ray origin
+     * @param[in] invDir    Component-wise reciprocal of the ray direction
+     * @param[in] tMax      Hits farther than this distance are ignored
+     * @return Distance to the entry point of the box (0 if the origin is inside), or FLT_MAX if the box is missed
+     */
+    float Intersect(const glm::vec3 &origin, const glm::vec3 &invDir, float tMax) const
+    {
+        glm::vec3 t0 = (min - origin) * invDir;
+        glm::vec3 t1 = (max - origin) * invDir;
+        glm::vec3 tNear = glm::min(t0, t1);
+        glm::vec3 tFar = glm::max(t0, t1);
+        float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+        float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+        return (tEnter <= tExit) ? tEnter : FLT_MAX;
+    }
+};
+
+/**
+ * Bump allocator for data that lives and dies together, such as the objects of a scene. Memory is handed out from
+ * large cache-line aligned blocks, so an allocation is a pointer increment, objects of one scene end up next to each
+ * other, and freeing everything costs one free per block plus the destructors of the objects that have one.
+ */
+struct Arena
+{
+    static const size_t BLOCK_SIZE = 1 << 20; // Size of a regular block; larger requests get a block of their own
+    static const size_t BLOCK_ALIGNMENT = 64; // Alignment of every block
+
+    Arena() {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        Release();
+    }
+
+    /**
+     * @brief Allocates uninitialized memory that stays valid until Release()
+     * @param[in] size      Number of bytes
+     * @param[in] alignment Alignment of the returned address, at most BLOCK_ALIGNMENT
+     */
+    void *Allocate(size_t size, size_t alignment)
+    {
+        uintptr_t start = ((uintptr_t)cursor + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        if (cursor == nullptr || start + size > (uintptr_t)end)
+        {
+            size_t blockSize = std::max(BLOCK_SIZE, size);
+            char *block = (char *)::operator new(blockSize + BLOCK_ALIGNMENT);
+            blocks.push_back(block);
+            cursor = (char *)(((uintptr_t)block + BLOCK_ALIGNMENT - 1) & ~(uintptr_t)(BLOCK_ALIGNMENT - 1));
+            end = cursor + blockSize;
+            start = (uintptr_t)cursor;
+        }
+        cursor = (char *)(start + size);
+        bytesUsed += size;
+        return (void *)start;
+    }
+
+    /**
+     * @brief Default-constructs an object in the arena. Its destructor, if it has one, runs in Release().
+     */
+    template <typename T>
+    T *New()
+    {
+        T *object = new (Allocate(sizeof(T), alignof(T))) T();
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            destructors.push_back({object, [](void *p) { ((T *)p)->T::~T(); }});
+        }
+        return object;
+    }
+
+    /**
+     * @brief Destroys every object and frees every block
+     */
+    void Release()
+    {
+        for (size_t i = destructors.size(); i > 0; i--)
+        {
+            destructors[i - 1].destroy(destructors[i - 1].object);
+        }
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            ::operator delete(blocks[i]);
+        }
+        destructors.clear();
+        blocks.clear();
+        cursor = nullptr;
+        end = nullptr;
+        bytesUsed = 0;
+    }
+
+    /**
+     * @brief Number of bytes handed out since the last Release()
+     */
+    size_t BytesUsed() const
+    {
+        return bytesUsed;
+    }
+
+private:
+    struct Destructor
+    {
+        void *object;             // Object to destroy
+        void (*destroy)(void *);  // Calls the object's destructor
+    };
+
+    std::vector<char *> blocks;         // Every block, as returned by operator new
+    std::vector<Destructor> destructors; // Objects to destroy in Release(), in construction order
+    char *cursor = nullptr;             // Next free byte of the current block
+    char *end = nullptr;                // End of the current block
+    size_t bytesUsed = 0;               // Bytes handed out
+};
+
 struct Material
 {
     glm::vec3 ambient;  // Ambient
@@ -27,18 +241,135 @@ struct Material
     float shininess;    // Shininess
 };
 
+typedef uint16_t MaterialId; // Index of a material in a MaterialTable
+
+// Materials of a scene, each stored once no matter how many objects use it. Objects refer to them by MaterialId.
+struct MaterialTable
+{
+    static const size_t MAX_MATERIALS = 65536; // Number of distinct MaterialId values
+
+    std::vector<Material> materials; // Distinct materials, indexed by MaterialId
+
+    /**
+     * @brief Looks up a material, adding it if no identical one is stored yet
+     * @param[in]  material Material to add
+     * @param[out] outId    Id of the stored material
+     * @return False if the material is new and the table is full
+     */
+    bool Add(const Material &material, MaterialId &outId)
+    {
+        std::string key((const char *)&material, sizeof(Material));
+        auto found = lookup.find(key);
+        if (found != lookup.end())
+        {
+            outId = found->second;
+            return true;
+        }
+        if (materials.size() >= MAX_MATERIALS)
+        {
+            return false;
+        }
+        outId = (MaterialId)materials.size();
+        materials.push_back(material);
+        lookup.emplace(key, outId);
+        return true;
+    }
+
+    const Material &operator[](MaterialId id) const
+    {
+        return materials[id];
+    }
+
+    size_t Size() const
+    {
+        return materials.size();
+    }
+
+private:
+    std::unordered_map<std::string, MaterialId> lookup; // Bytes of every stored material, to find duplicates
+};
+
+// Minimal record of the closest hit found so far while casting a ray
+struct HitRecord
+{
+    float t;    // Distance from the ray's origin to the hit
+    int primId; // Index of the hit object in Scene::objects, or -1 if nothing was hit
+    float u;    // Barycentric coordinate of the hit (triangles only)
+    float v;    // Barycentric coordinate of the hit (triangles only)
+    int subId;  // Primitive hit inside the object (triangle or face of a mesh, 0 for other objects)
+};
+
 struct SceneObject
 {
-    Material material; // Material
+    MaterialId materialId = 0; // Index of the material in Scene::materials
+
+    virtual ~SceneObject() {}
 
     /**
      * Template function for calculating the intersection of this object with the provided ray.
+     * The default runs the distance-only test and only computes the point and normal if it hits.
      * @param[in]   incomingRay             Ray that will be checked for intersection with this object
      * @param[out]  outIntersectionPoint    Point of intersection (in case there is an intersection)
      * @param[out]  outIntersectionNormal   Normal vector at the point of intersection (in case there is an intersection)
      * @return If there is an intersection, returns the distance from the ray origin to the intersection point. Otherwise, returns a negative number.
      */
-    virtual float Intersect(const Ray &incomingRay, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal) = 0;
+    virtual float Intersect(const Ray &incomingRay, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal)
+    {
+        HitRecord hit;
+        hit.t = IntersectDistance(incomingRay, FLT_MAX, hit.u, hit.v, hit.subId);
+        if (hit.t > 0)
+        {
+            ComputeSurface(incomingRay, hit, outIntersectionPoint, outIntersectionNormal);
+        }
+        return hit.t;
+    }
+
+    /**
+     * @brief Distance-only intersection test used while searching for the closest hit
+     * @param[in]   incomingRay Ray that will be checked for intersection with this object
+     * @param[in]   tMax        Hits at or beyond this distance are ignored
+     * @param[out]  outU        First barycentric coordinate of the hit (only meaningful for triangles)
+     * @param[out]  outV        Second barycentric coordinate of the hit (only meaningful for triangles)
+     * @param[out]  outSubId    Primitive hit inside the object (only meaningful for objects made of several primitives)
+     * @return If there is an intersection in (0, tMax), returns the distance from the ray origin to the intersection point. Otherwise, returns a negative number.
+     */
+    virtual float IntersectDistance(const Ray &incomingRay, float tMax, float &outU, float &outV, int &outSubId) const = 0;
+
+    /**
+     * @brief Computes the intersection point and normal of a hit found by IntersectDistance()
+     * @param[in]   incomingRay             Ray that hit this object
+     * @param[in]   hit                     Hit record filled from IntersectDistance()
+     * @param[out]  outIntersectionPoint    Point of intersection
+     * @param[out]  outIntersectionNormal   Normal vector at the point of intersection
+     */
+    virtual void ComputeSurface(const Ray &incomingRay, const HitRecord &hit, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal) const = 0;
+
+    /**
+     * @brief Any-hit test used for shadow rays. Only decides whether there is a hit, without computing where.
+     * @param[in] incomingRay   Ray that will be checked for intersection with this object
+     * @param[in] tMax          Hits at or beyond this distance are ignored
+     * @return True if the ray intersects this object at a distance in (0, tMax)
+     */
+    virtual bool Occluded(const Ray &incomingRay, float tMax) const = 0;
+
+    /**
+     * @brief Bounding box of this object, used to build the BVH
+     */
+    virtual AABB GetBounds() const = 0;
+
+    /**
+     * @brief Updates data derived from the object's shape. Must be called after the shape is modified.
+     */
+    virtual void Precompute() {}
+
+    /**
+     * @brief Material at a hit found by IntersectDistance(), for objects whose material varies over their surface
+     * @param[in] hit Hit on this object
+     */
+    virtual MaterialId GetMaterialId(const HitRecord &) const
+    {
+        return materialId;
+    }
 };
 
 // Subclass of SceneObject representing a Sphere scene object
@@ -133,8 +464,105 @@ struct Sphere : public SceneObject
 
         return t;
     }
+
+    virtual float IntersectDistance(const Ray &incomingRay, float tMax, float &outU, float &outV, int &outSubId) const
+    {
+        glm::vec3 m = incomingRay.origin - center;
+        float b = glm::dot(m, incomingRay.direction);
+        float c = glm::dot(m, m) - (radius * radius);
+        float isIntersecting = (b * b) - c;
+        if (isIntersecting < 0)
+        {
+            return -1.0f;
+        }
+
+        // Nearest positive root
+        float root = sqrt(isIntersecting);
+        float t = -b - root;
+        if (t <= 0)
+        {
+            t = -b + root;
+        }
+        if (t >= tMax)
+        {
+            return -1.0f;
+        }
+        outU = 0.0f;
+        outV = 0.0f;
+        outSubId = 0;
+        return t;
+    }
+
+    virtual void ComputeSurface(const Ray &incomingRay, const HitRecord &hit, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal) const
+    {
+        outIntersectionPoint = incomingRay.origin + (hit.t * incomingRay.direction);
+        outIntersectionNormal = glm::normalize(outIntersectionPoint - center);
+    }
+
+    virtual bool Occluded(const Ray &incomingRay, float tMax) const
+    {
+        float u, v;
+        int subId;
+        return IntersectDistance(incomingRay, tMax, u, v, subId) > 0;
+    }
+
+    virtual AABB GetBounds() const
+    {
+        AABB bounds;
+        bounds.Grow(center - glm::vec3(radius));
+        bounds.Grow(center + glm::vec3(radius));
+        return bounds;
+    }
+};
+
+// Triangle in the form used by the intersection kernel, computed once from the three points
+struct TriangleData
+{
+    glm::vec3 A;      // First point
+    glm::vec3 edge1;  // B - A
+    glm::vec3 edge2;  // C - A
+    glm::vec3 normal; // cross(edge1, edge2), not normalized
 };
 
+/**
+ * @brief Ray-triangle intersection kernel (Moller-Trumbore, with the normal precomputed). Only the front
+ * side is hit. Rejections are decided on the numerators, and divisions only happen for accepted hits.
+ * @param[in]   tri     Precomputed triangle
+ * @param[in]   origin  Ray origin
+ * @param[in]   dir     Ray direction
+ * @param[in]   tMax    Hits at or beyond this distance are ignored
+ * @param[out]  outU    Barycentric coordinate along edge1
+ * @param[out]  outV    Barycentric coordinate along edge2
+ * @return Distance to the hit, or a negative number if there is no hit in (0, tMax)
+ */
+inline float IntersectTriangle(const TriangleData &tri, const glm::vec3 &origin, const glm::vec3 &dir, float tMax, float &outU, float &outV)
+{
+    float f = -glm::dot(dir, tri.normal);
+    if (f <= 0)
+    {
+        return -1.0f;
+    }
+
+    glm::vec3 m = origin - tri.A;
+    float tNumerator = glm::dot(m, tri.normal);
+    if (tNumerator <= 0 || tNumerator >= tMax * f)
+    {
+        return -1.0f;
+    }
+
+    glm::vec3 e = glm::cross(-dir, m);
+    float uNumerator = glm::dot(tri.edge2, e);
+    float vNumerator = -glm::dot(tri.edge1, e);
+    if (uNumerator < 0 || vNumerator < 0 || uNumerator + vNumerator > f)
+    {
+        return -1.0f;
+    }
+
+    outU = uNumerator / f;
+    outV = vNumerator / f;
+    return tNumerator / f;
+}
+
 // Subclass of SceneObject representing a Triangle scene object
 struct Triangle : public SceneObject
 {
@@ -142,6 +570,9 @@ struct Triangle : public SceneObject
     glm::vec3 B; // Second point
     glm::vec3 C; // Third point
 
+    TriangleData data;    // Precomputed edges and normal, updated by Precompute()
+    glm::vec3 unitNormal; // Normalized face normal, updated by Precompute()
+
     /**
      * @brief Ray-Triangle intersection
      * @param[in]   incomingRay             Ray that will be checked for intersection with this object
@@ -201,712 +632,6548 @@ struct Triangle : public SceneObject
 
         return s;
     }
-};
 
-struct Camera
-{
-    glm::vec3 position;   // Position
-    glm::vec3 lookTarget; // Look target
-    glm::vec3 globalUp;   // Global up-vector
-    float fovY;           // Vertical field of view
-    float focalLength;    // Focal length
+    virtual float IntersectDistance(const Ray &incomingRay, float tMax, float &outU, float &outV, int &outSubId) const
+    {
+        outSubId = 0;
+        return IntersectTriangle(data, incomingRay.origin, incomingRay.direction, tMax, outU, outV);
+    }
 
-    int imageWidth;  // image width
-    int imageHeight; // image height
-};
+    virtual void ComputeSurface(const Ray &, const HitRecord &hit, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal) const
+    {
+        outIntersectionPoint = A + (hit.u * data.edge1) + (hit.v * data.edge2);
+        outIntersectionNormal = unitNormal;
+    }
 
-struct Light
-{
-    glm::vec4 position; // Light position (w = 1 if point light, w = 0 if directional light)
+    virtual bool Occluded(const Ray &incomingRay, float tMax) const
+    {
+        float u, v;
+        return IntersectTriangle(data, incomingRay.origin, incomingRay.direction, tMax, u, v) > 0;
+    }
 
-    glm::vec3 ambient;  // Light's ambient intensity
-    glm::vec3 diffuse;  // Light's diffuse intensity
-    glm::vec3 specular; // Light's specular intensity
+    virtual void Precompute()
+    {
+        data.A = A;
+        data.edge1 = B - A;
+        data.edge2 = C - A;
+        data.normal = glm::cross(data.edge1, data.edge2);
+        unitNormal = glm::normalize(data.normal);
+    }
 
-    // --- Attenuation variables ---
-    float constant;  // Constant factor
-    float linear;    // Linear factor
-    float quadratic; // Quadratic factor
+    virtual AABB GetBounds() const
+    {
+        AABB bounds;
+        bounds.Grow(A);
+        bounds.Grow(B);
+        bounds.Grow(C);
+        return bounds;
+    }
 };
 
-struct IntersectionInfo
-{
-    Ray incomingRay;              // Ray used to calculate the intersection
-    float t;                      // Distance from the ray's origin to the point of intersection (if there was an intersection).
-    SceneObject *obj;             // Object that the ray intersected with. If this is equal to nullptr, then no intersection occured.
-    glm::vec3 intersectionPoint;  // Point where the intersection occured (if there was an intersection)
-    glm::vec3 intersectionNormal; // Normal vector at the point of intersection (if there was an intersection)
-};
+const int SIMD_MAX_WIDTH = 8; // Widest kernel, also the padding at the end of every SoA array
 
-struct Scene
+// Structure-of-arrays copy of the scene's triangles, stored in BVH leaf order
+struct TriangleSoA
 {
-    std::vector<SceneObject *> objects; // List of all objects in the scene
-    std::vector<Light> lights;          // List of all lights in the scene
-};
+    std::vector<float> ax, ay, az;    // First point
+    std::vector<float> e1x, e1y, e1z; // B - A
+    std::vector<float> e2x, e2y, e2z; // C - A
+    std::vector<float> nx, ny, nz;    // Unnormalized normal
+    std::vector<int> objectIds;       // Index of each triangle in Scene::objects
 
-struct Image
-{
-    std::vector<unsigned char> data; // Image data
-    int width;                       // Image width
-    int height;                      // Image height
+    void Clear()
+    {
+        std::vector<float> *arrays[] = {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz};
+        for (std::vector<float> *a : arrays)
+        {
+            a->clear();
+        }
+        objectIds.clear();
+    }
 
-    /**
-     * @brief Constructor
-     * @param[in] w Width
-     * @param[in] h Height
-     */
-    Image(const int &w, const int &h)
-        : width(w), height(h)
+    void Add(const TriangleData &tri, int objectId)
     {
-        data.resize(w * h * 3, 0);
+        ax.push_back(tri.A.x);
+        ay.push_back(tri.A.y);
+        az.push_back(tri.A.z);
+        e1x.push_back(tri.edge1.x);
+        e1y.push_back(tri.edge1.y);
+        e1z.push_back(tri.edge1.z);
+        e2x.push_back(tri.edge2.x);
+        e2y.push_back(tri.edge2.y);
+        e2z.push_back(tri.edge2.z);
+        nx.push_back(tri.normal.x);
+        ny.push_back(tri.normal.y);
+        nz.push_back(tri.normal.z);
+        objectIds.push_back(objectId);
     }
 
     /**
-     * @brief Converts the provided color value from [0, 1] to [0, 255]
-     * @param[in] c Color value in [0, 1] range
-     * @return Color value in [0, 255] range
+     * @brief Overwrites the triangle stored at the given position, keeping its object id
      */
-    unsigned char ToChar(float c)
+    void Set(size_t slot, const TriangleData &tri)
     {
-        c = glm::clamp(c, 0.0f, 1.0f);
-        return static_cast<unsigned char>(c * 255);
+        ax[slot] = tri.A.x;
+        ay[slot] = tri.A.y;
+        az[slot] = tri.A.z;
+        e1x[slot] = tri.edge1.x;
+        e1y[slot] = tri.edge1.y;
+        e1z[slot] = tri.edge1.z;
+        e2x[slot] = tri.edge2.x;
+        e2y[slot] = tri.edge2.y;
+        e2z[slot] = tri.edge2.z;
+        nx[slot] = tri.normal.x;
+        ny[slot] = tri.normal.y;
+        nz[slot] = tri.normal.z;
     }
 
     /**
-     * @brief Sets the color at the specified pixel location
-     * @param[in] x     X-coordinate of the pixel
-     * @param[in] y     Y-coordinate of the pixel
-     * @param[in] color Pixel color
+     * @brief Appends SIMD_MAX_WIDTH zeroed entries so that a full-width load starting at any element stays in bounds
      */
-    void SetColor(const int &x, const int &y, const glm::vec3 &color)
+    void Pad()
     {
-        int index = (y * width + x) * 3;
-        data[index] = ToChar(color.r);
-        data[index + 1] = ToChar(color.g);
-        data[index + 2] = ToChar(color.b);
+        size_t count = objectIds.size();
+        std::vector<float> *arrays[] = {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz};
+        for (std::vector<float> *a : arrays)
+        {
+            a->resize(count + SIMD_MAX_WIDTH, 0.0f);
+        }
     }
 };
 
-/**
- * @brief Gets the ray that goes from the camera's position to the specified pixel at (x, y)
- * @param[in] camera Camera data
- * @param[in] x X-coordinate of the pixel (upper-left corner of the pixel)
- * @param[in] y Y-coordinate of the pixel (upper-left corner of the pixel)
- * @return Ray that passes through the pixel at (x, y)
- */
-Ray GetRayThruPixel(const Camera &camera, const int &pixelX, const int &pixelY)
+// Structure-of-arrays copy of the scene's spheres, stored in BVH leaf order
+struct SphereSoA
 {
-    Ray ray;
-    ray.origin = camera.position;
+    std::vector<float> cx, cy, cz;  // Center
+    std::vector<float> radius2;     // Squared radius
+    std::vector<int> objectIds;     // Index of each sphere in Scene::objects
 
-    // viewport calculations (slide 17)
-    float aspectRatio = camera.imageWidth / (float)camera.imageHeight;
-    float hViewport = 2 * camera.focalLength * tan((camera.fovY * M_PI / 180) / 2);
-    float wViewport = aspectRatio * hViewport;
+    void Clear()
+    {
+        cx.clear();
+        cy.clear();
+        cz.clear();
+        radius2.clear();
+        objectIds.clear();
+    }
 
-    // vector u and vector v calculations (slide 19)
-    glm::vec3 lookDirection = glm::normalize(camera.lookTarget - ray.origin);
+    void Add(const glm::vec3 &center, float radius, int objectId)
+    {
+        cx.push_back(center.x);
+        cy.push_back(center.y);
+        cz.push_back(center.z);
+        radius2.push_back(radius * radius);
+        objectIds.push_back(objectId);
+    }
+
+    /**
+     * @brief Overwrites the sphere stored at the given position, keeping its object id
+     */
+    void Set(size_t slot, const glm::vec3 &center, float radius)
+    {
+        cx[slot] = center.x;
+        cy[slot] = center.y;
+        cz[slot] = center.z;
+        radius2[slot] = radius * radius;
+    }
+
+    /**
+     * @brief Appends SIMD_MAX_WIDTH zeroed entries so that a full-width load starting at any element stays in bounds
+     */
+    void Pad()
+    {
+        size_t count = objectIds.size();
+        cx.resize(count + SIMD_MAX_WIDTH, 0.0f);
+        cy.resize(count + SIMD_MAX_WIDTH, 0.0f);
+        cz.resize(count + SIMD_MAX_WIDTH, 0.0f);
+        radius2.resize(count + SIMD_MAX_WIDTH, 0.0f);
+    }
+};
+
+// Output of a triangle block test. Barycentrics are left as numerators so that only the winner pays for the division.
+struct TriangleBlockResult
+{
+    float t[SIMD_MAX_WIDTH];          // Hit distance of every lane
+    float uNumerator[SIMD_MAX_WIDTH]; // u * f
+    float vNumerator[SIMD_MAX_WIDTH]; // v * f
+    float f[SIMD_MAX_WIDTH];          // Denominator shared by t, u and v
+};
+
+/**
+ * Block kernels test one ray against `width` consecutive primitives starting at `first`, with the same arithmetic as
+ * IntersectTriangle() and Sphere::IntersectDistance(). They return a bit mask of the lanes that hit in (0, tMax);
+ * lanes past the end of the caller's range must be masked out by the caller.
+ */
+typedef int (*TriangleBlockKernel)(const TriangleSoA &tris, int first, const Ray &ray, float tMax, TriangleBlockResult &result);
+typedef int (*SphereBlockKernel)(const SphereSoA &spheres, int first, const Ray &ray, float tMax, float *outT);
+
+inline int TriangleBlockScalar(const TriangleSoA &tris, int first, const Ray &ray, float tMax, TriangleBlockResult &result)
+{
+    TriangleData tri;
+    tri.A = glm::vec3(tris.ax[first], tris.ay[first], tris.az[first]);
+    tri.edge1 = glm::vec3(tris.e1x[first], tris.e1y[first], tris.e1z[first]);
+    tri.edge2 = glm::vec3(tris.e2x[first], tris.e2y[first], tris.e2z[first]);
+    tri.normal = glm::vec3(tris.nx[first], tris.ny[first], tris.nz[first]);
+
+    float u, v;
+    float t = IntersectTriangle(tri, ray.origin, ray.direction, tMax, u, v);
+    if (t <= 0)
+    {
+        return 0;
+    }
+    result.t[0] = t;
+    result.uNumerator[0] = u;
+    result.vNumerator[0] = v;
+    result.f[0] = 1.0f;
+    return 1;
+}
+
+inline int SphereBlockScalar(const SphereSoA &spheres, int first, const Ray &ray, float tMax, float *outT)
+{
+    glm::vec3 m = ray.origin - glm::vec3(spheres.cx[first], spheres.cy[first], spheres.cz[first]);
+    float b = glm::dot(m, ray.direction);
+    float c = glm::dot(m, m) - spheres.radius2[first];
+    float isIntersecting = (b * b) - c;
+    if (isIntersecting < 0)
+    {
+        return 0;
+    }
+
+    float root = sqrt(isIntersecting);
+    float t = -b - root;
+    if (t <= 0)
+    {
+        t = -b + root;
+    }
+    outT[0] = t;
+    return (t > 0 && t < tMax) ? 1 : 0;
+}
+
+#if defined(RT_X86)
+int TriangleBlockSSE(const TriangleSoA &tris, int first, const Ray &ray, float tMax, TriangleBlockResult &result)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 dx = _mm_set1_ps(ray.direction.x);
+    __m128 dy = _mm_set1_ps(ray.direction.y);
+    __m128 dz = _mm_set1_ps(ray.direction.z);
+
+    // f = -dot(d, n)
+    __m128 nx = _mm_loadu_ps(&tris.nx[first]);
+    __m128 ny = _mm_loadu_ps(&tris.ny[first]);
+    __m128 nz = _mm_loadu_ps(&tris.nz[first]);
+    __m128 f = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz)));
+
+    // t * f = dot(o - A, n)
+    __m128 mx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&tris.ax[first]));
+    __m128 my = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&tris.ay[first]));
+    __m128 mz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&tris.az[first]));
+    __m128 tNumerator = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, nx), _mm_mul_ps(my, ny)), _mm_mul_ps(mz, nz));
+
+    // e = cross(-d, o - A)
+    __m128 ndx = _mm_sub_ps(zero, dx);
+    __m128 ndy = _mm_sub_ps(zero, dy);
+    __m128 ndz = _mm_sub_ps(zero, dz);
+    __m128 ex = _mm_sub_ps(_mm_mul_ps(ndy, mz), _mm_mul_ps(my, ndz));
+    __m128 ey = _mm_sub_ps(_mm_mul_ps(ndz, mx), _mm_mul_ps(mz, ndx));
+    __m128 ez = _mm_sub_ps(_mm_mul_ps(ndx, my), _mm_mul_ps(mx, ndy));
+
+    __m128 uNumerator = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&tris.e2x[first]), ex), _mm_mul_ps(_mm_loadu_ps(&tris.e2y[first]), ey)), _mm_mul_ps(_mm_loadu_ps(&tris.e2z[first]), ez));
+    __m128 vNumerator = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&tris.e1x[first]), ex), _mm_mul_ps(_mm_loadu_ps(&tris.e1y[first]), ey)), _mm_mul_ps(_mm_loadu_ps(&tris.e1z[first]), ez)));
+
+    __m128 valid = _mm_cmpgt_ps(f, zero);
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(tNumerator, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(tNumerator, _mm_mul_ps(_mm_set1_ps(tMax), f)));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(uNumerator, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(vNumerator, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(uNumerator, vNumerator), f));
+
+    int mask = _mm_movemask_ps(valid);
+    if (mask != 0)
+    {
+        _mm_storeu_ps(result.t, _mm_div_ps(tNumerator, f));
+        _mm_storeu_ps(result.uNumerator, uNumerator);
+        _mm_storeu_ps(result.vNumerator, vNumerator);
+        _mm_storeu_ps(result.f, f);
+    }
+    return mask;
+}
+
+int SphereBlockSSE(const SphereSoA &spheres, int first, const Ray &ray, float tMax, float *outT)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 mx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&spheres.cx[first]));
+    __m128 my = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&spheres.cy[first]));
+    __m128 mz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&spheres.cz[first]));
+
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, _mm_set1_ps(ray.direction.x)), _mm_mul_ps(my, _mm_set1_ps(ray.direction.y))), _mm_mul_ps(mz, _mm_set1_ps(ray.direction.z)));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, mx), _mm_mul_ps(my, my)), _mm_mul_ps(mz, mz)), _mm_loadu_ps(&spheres.radius2[first]));
+    __m128 isIntersecting = _mm_sub_ps(_mm_mul_ps(b, b), c);
+    __m128 valid = _mm_cmpge_ps(isIntersecting, zero);
+    if (_mm_movemask_ps(valid) == 0)
+    {
+        return 0;
+    }
+
+    // Nearest positive root
+    __m128 root = _mm_sqrt_ps(_mm_max_ps(isIntersecting, zero));
+    __m128 negB = _mm_sub_ps(zero, b);
+    __m128 tNear = _mm_sub_ps(negB, root);
+    __m128 tFar = _mm_add_ps(negB, root);
+    __m128 useFar = _mm_cmple_ps(tNear, zero);
+    __m128 t = _mm_or_ps(_mm_and_ps(useFar, tFar), _mm_andnot_ps(useFar, tNear));
+
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(outT, t);
+    return _mm_movemask_ps(valid);
+}
+
+RT_TARGET_AVX2 int TriangleBlockAVX2(const TriangleSoA &tris, int first, const Ray &ray, float tMax, TriangleBlockResult &result)
+{
+    __m256 zero = _mm256_setzero_ps();
+    __m256 dx = _mm256_set1_ps(ray.direction.x);
+    __m256 dy = _mm256_set1_ps(ray.direction.y);
+    __m256 dz = _mm256_set1_ps(ray.direction.z);
+
+    // f = -dot(d, n)
+    __m256 nx = _mm256_loadu_ps(&tris.nx[first]);
+    __m256 ny = _mm256_loadu_ps(&tris.ny[first]);
+    __m256 nz = _mm256_loadu_ps(&tris.nz[first]);
+    __m256 f = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, nx), _mm256_mul_ps(dy, ny)), _mm256_mul_ps(dz, nz)));
+
+    // t * f = dot(o - A, n)
+    __m256 mx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&tris.ax[first]));
+    __m256 my = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&tris.ay[first]));
+    __m256 mz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&tris.az[first]));
+    __m256 tNumerator = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(mx, nx), _mm256_mul_ps(my, ny)), _mm256_mul_ps(mz, nz));
+
+    // e = cross(-d, o - A)
+    __m256 ndx = _mm256_sub_ps(zero, dx);
+    __m256 ndy = _mm256_sub_ps(zero, dy);
+    __m256 ndz = _mm256_sub_ps(zero, dz);
+    __m256 ex = _mm256_sub_ps(_mm256_mul_ps(ndy, mz), _mm256_mul_ps(my, ndz));
+    __m256 ey = _mm256_sub_ps(_mm256_mul_ps(ndz, mx), _mm256_mul_ps(mz, ndx));
+    __m256 ez = _mm256_sub_ps(_mm256_mul_ps(ndx, my), _mm256_mul_ps(mx, ndy));
+
+    __m256 uNumerator = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&tris.e2x[first]), ex), _mm256_mul_ps(_mm256_loadu_ps(&tris.e2y[first]), ey)), _mm256_mul_ps(_mm256_loadu_ps(&tris.e2z[first]), ez));
+    __m256 vNumerator = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&tris.e1x[first]), ex), _mm256_mul_ps(_mm256_loadu_ps(&tris.e1y[first]), ey)), _mm256_mul_ps(_mm256_loadu_ps(&tris.e1z[first]), ez)));
+
+    __m256 valid = _mm256_cmp_ps(f, zero, _CMP_GT_OQ);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(tNumerator, zero, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(tNumerator, _mm256_mul_ps(_mm256_set1_ps(tMax), f), _CMP_LT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(uNumerator, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(vNumerator, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(uNumerator, vNumerator), f, _CMP_LE_OQ));
+
+    int mask = _mm256_movemask_ps(valid);
+    if (mask != 0)
+    {
+        _mm256_storeu_ps(result.t, _mm256_div_ps(tNumerator, f));
+        _mm256_storeu_ps(result.uNumerator, uNumerator);
+        _mm256_storeu_ps(result.vNumerator, vNumerator);
+        _mm256_storeu_ps(result.f, f);
+    }
+    return mask;
+}
+
+RT_TARGET_AVX2 int SphereBlockAVX2(const SphereSoA &spheres, int first, const Ray &ray, float tMax, float *outT)
+{
+    __m256 zero = _mm256_setzero_ps();
+    __m256 mx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&spheres.cx[first]));
+    __m256 my = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&spheres.cy[first]));
+    __m256 mz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&spheres.cz[first]));
+
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(mx, _mm256_set1_ps(ray.direction.x)), _mm256_mul_ps(my, _mm256_set1_ps(ray.direction.y))), _mm256_mul_ps(mz, _mm256_set1_ps(ray.direction.z)));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(mx, mx), _mm256_mul_ps(my, my)), _mm256_mul_ps(mz, mz)), _mm256_loadu_ps(&spheres.radius2[first]));
+    __m256 isIntersecting = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+    __m256 valid = _mm256_cmp_ps(isIntersecting, zero, _CMP_GE_OQ);
+    if (_mm256_movemask_ps(valid) == 0)
+    {
+        return 0;
+    }
+
+    // Nearest positive root
+    __m256 root = _mm256_sqrt_ps(_mm256_max_ps(isIntersecting, zero));
+    __m256 negB = _mm256_sub_ps(zero, b);
+    __m256 tNear = _mm256_sub_ps(negB, root);
+    __m256 tFar = _mm256_add_ps(negB, root);
+    __m256 t = _mm256_blendv_ps(tNear, tFar, _mm256_cmp_ps(tNear, zero, _CMP_LE_OQ));
+
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+    _mm256_storeu_ps(outT, t);
+    return _mm256_movemask_ps(valid);
+}
+#endif
+
+const int PACKET_WIDTH = 4;                           // Packet width in pixels
+const int PACKET_HEIGHT = 4;                          // Packet height in pixels
+const int PACKET_SIZE = PACKET_WIDTH * PACKET_HEIGHT; // Rays per packet, one bit each in a lane mask
+
+// Bundle of rays that traverse the BVH together. Origins, reciprocal directions and distance limits are
+// stored as structure of arrays for the SIMD bounds tests.
+struct RayPacket
+{
+    Ray rays[PACKET_SIZE];             // Rays, for the per-ray leaf tests
+    alignas(32) float ox[PACKET_SIZE]; // Origin x
+    alignas(32) float oy[PACKET_SIZE]; // Origin y
+    alignas(32) float oz[PACKET_SIZE]; // Origin z
+    alignas(32) float ix[PACKET_SIZE]; // 1 / direction x
+    alignas(32) float iy[PACKET_SIZE]; // 1 / direction y
+    alignas(32) float iz[PACKET_SIZE]; // 1 / direction z
+    alignas(32) float tMax[PACKET_SIZE]; // Closest hit so far (or maximum distance) of every ray
+
+    /**
+     * @brief Stores a ray in a lane
+     * @param[in] lane          Lane index
+     * @param[in] ray           Ray
+     * @param[in] maxDistance   Hits at or beyond this distance are ignored
+     */
+    void Set(int lane, const Ray &ray, float maxDistance)
+    {
+        rays[lane] = ray;
+        glm::vec3 invDir = 1.0f / ray.direction;
+        ox[lane] = ray.origin.x;
+        oy[lane] = ray.origin.y;
+        oz[lane] = ray.origin.z;
+        ix[lane] = invDir.x;
+        iy[lane] = invDir.y;
+        iz[lane] = invDir.z;
+        tMax[lane] = maxDistance;
+    }
+
+    /**
+     * @brief Checks that all active rays point into the same octant, so that one traversal order suits all of them
+     */
+    bool IsCoherent(int activeMask) const
+    {
+        int signs = -1;
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            if (activeMask & (1 << lane))
+            {
+                int laneSigns = (ix[lane] < 0 ? 1 : 0) | (iy[lane] < 0 ? 2 : 0) | (iz[lane] < 0 ? 4 : 0);
+                if (signs >= 0 && laneSigns != signs)
+                {
+                    return false;
+                }
+                signs = laneSigns;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Packet box kernels run the slab test of AABB::Intersect() for every lane of a packet (with the same min/max
+ * operand order, so NaN cases resolve the same way) and return the mask of active lanes that hit the box.
+ */
+typedef int (*PacketBoxKernel)(const RayPacket &packet, const AABB &box, int activeMask);
+
+int PacketBoxScalar(const RayPacket &packet, const AABB &box, int activeMask)
+{
+    int mask = 0;
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        if ((activeMask & (1 << lane)) &&
+            box.Intersect(glm::vec3(packet.ox[lane], packet.oy[lane], packet.oz[lane]), glm::vec3(packet.ix[lane], packet.iy[lane], packet.iz[lane]), packet.tMax[lane]) != FLT_MAX)
+        {
+            mask |= 1 << lane;
+        }
+    }
+    return mask;
+}
+
+#if defined(RT_X86)
+int PacketBoxSSE(const RayPacket &packet, const AABB &box, int activeMask)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 minX = _mm_set1_ps(box.min.x), minY = _mm_set1_ps(box.min.y), minZ = _mm_set1_ps(box.min.z);
+    __m128 maxX = _mm_set1_ps(box.max.x), maxY = _mm_set1_ps(box.max.y), maxZ = _mm_set1_ps(box.max.z);
+
+    int mask = 0;
+    for (int i = 0; i < PACKET_SIZE; i += 4)
+    {
+        if (((activeMask >> i) & 0xF) == 0)
+        {
+            continue;
+        }
+        __m128 ox = _mm_load_ps(&packet.ox[i]), oy = _mm_load_ps(&packet.oy[i]), oz = _mm_load_ps(&packet.oz[i]);
+        __m128 ix = _mm_load_ps(&packet.ix[i]), iy = _mm_load_ps(&packet.iy[i]), iz = _mm_load_ps(&packet.iz[i]);
+        __m128 t0x = _mm_mul_ps(_mm_sub_ps(minX, ox), ix), t1x = _mm_mul_ps(_mm_sub_ps(maxX, ox), ix);
+        __m128 t0y = _mm_mul_ps(_mm_sub_ps(minY, oy), iy), t1y = _mm_mul_ps(_mm_sub_ps(maxY, oy), iy);
+        __m128 t0z = _mm_mul_ps(_mm_sub_ps(minZ, oz), iz), t1z = _mm_mul_ps(_mm_sub_ps(maxZ, oz), iz);
+        __m128 nearX = _mm_min_ps(t1x, t0x), nearY = _mm_min_ps(t1y, t0y), nearZ = _mm_min_ps(t1z, t0z);
+        __m128 farX = _mm_max_ps(t1x, t0x), farY = _mm_max_ps(t1y, t0y), farZ = _mm_max_ps(t1z, t0z);
+        __m128 tEnter = _mm_max_ps(_mm_max_ps(zero, nearZ), _mm_max_ps(nearY, nearX));
+        __m128 tExit = _mm_min_ps(_mm_min_ps(_mm_load_ps(&packet.tMax[i]), farZ), _mm_min_ps(farY, farX));
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) << i;
+    }
+    return mask & activeMask;
+}
+
+RT_TARGET_AVX2 int PacketBoxAVX2(const RayPacket &packet, const AABB &box, int activeMask)
+{
+    __m256 zero = _mm256_setzero_ps();
+    __m256 minX = _mm256_set1_ps(box.min.x), minY = _mm256_set1_ps(box.min.y), minZ = _mm256_set1_ps(box.min.z);
+    __m256 maxX = _mm256_set1_ps(box.max.x), maxY = _mm256_set1_ps(box.max.y), maxZ = _mm256_set1_ps(box.max.z);
+
+    int mask = 0;
+    for (int i = 0; i < PACKET_SIZE; i += 8)
+    {
+        if (((activeMask >> i) & 0xFF) == 0)
+        {
+            continue;
+        }
+        __m256 ox = _mm256_load_ps(&packet.ox[i]), oy = _mm256_load_ps(&packet.oy[i]), oz = _mm256_load_ps(&packet.oz[i]);
+        __m256 ix = _mm256_load_ps(&packet.ix[i]), iy = _mm256_load_ps(&packet.iy[i]), iz = _mm256_load_ps(&packet.iz[i]);
+        __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(minX, ox), ix), t1x = _mm256_mul_ps(_mm256_sub_ps(maxX, ox), ix);
+        __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(minY, oy), iy), t1y = _mm256_mul_ps(_mm256_sub_ps(maxY, oy), iy);
+        __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(minZ, oz), iz), t1z = _mm256_mul_ps(_mm256_sub_ps(maxZ, oz), iz);
+        __m256 nearX = _mm256_min_ps(t1x, t0x), nearY = _mm256_min_ps(t1y, t0y), nearZ = _mm256_min_ps(t1z, t0z);
+        __m256 farX = _mm256_max_ps(t1x, t0x), farY = _mm256_max_ps(t1y, t0y), farZ = _mm256_max_ps(t1z, t0z);
+        __m256 tEnter = _mm256_max_ps(_mm256_max_ps(zero, nearZ), _mm256_max_ps(nearY, nearX));
+        __m256 tExit = _mm256_min_ps(_mm256_min_ps(_mm256_load_ps(&packet.tMax[i]), farZ), _mm256_min_ps(farY, farX));
+        mask |= _mm256_movemask_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ)) << i;
+    }
+    return mask & activeMask;
+}
+#endif
+
+/**
+ * Camera ray kernels build the ray directions of a run of pixels in one image row, as
+ * normalize(((lowerLeft + column offset) + rowOffset) - origin), in the same operation order as GetRayThruPixel().
+ * The scalar kernel does one pixel per call, SSE 4 and AVX2 8. Zero-length directions are left as they are.
+ */
+typedef void (*CameraRayKernel)(const float *columnX, const float *columnY, const float *columnZ, const glm::vec3 &lowerLeft, const glm::vec3 &rowOffset,
+                                const glm::vec3 &origin, float *outX, float *outY, float *outZ);
+
+void CameraRayScalar(const float *columnX, const float *columnY, const float *columnZ, const glm::vec3 &lowerLeft, const glm::vec3 &rowOffset,
+                     const glm::vec3 &origin, float *outX, float *outY, float *outZ)
+{
+    glm::vec3 P = lowerLeft + glm::vec3(columnX[0], columnY[0], columnZ[0]) + rowOffset;
+    glm::vec3 rayDirection = P - origin;
+    if (rayDirection != glm::vec3(0.0f))
+    {
+        rayDirection = glm::normalize(rayDirection);
+    }
+    outX[0] = rayDirection.x;
+    outY[0] = rayDirection.y;
+    outZ[0] = rayDirection.z;
+}
+
+#if defined(RT_X86)
+void CameraRaySSE(const float *columnX, const float *columnY, const float *columnZ, const glm::vec3 &lowerLeft, const glm::vec3 &rowOffset,
+                  const glm::vec3 &origin, float *outX, float *outY, float *outZ)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_set1_ps(lowerLeft.x), _mm_loadu_ps(columnX)), _mm_set1_ps(rowOffset.x)), _mm_set1_ps(origin.x));
+    __m128 dy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_set1_ps(lowerLeft.y), _mm_loadu_ps(columnY)), _mm_set1_ps(rowOffset.y)), _mm_set1_ps(origin.y));
+    __m128 dz = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_set1_ps(lowerLeft.z), _mm_loadu_ps(columnZ)), _mm_set1_ps(rowOffset.z)), _mm_set1_ps(origin.z));
+    __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 invLength = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(dot));
+    __m128 nonZero = _mm_or_ps(_mm_or_ps(_mm_cmpneq_ps(dx, zero), _mm_cmpneq_ps(dy, zero)), _mm_cmpneq_ps(dz, zero));
+    _mm_storeu_ps(outX, _mm_or_ps(_mm_and_ps(nonZero, _mm_mul_ps(dx, invLength)), _mm_andnot_ps(nonZero, dx)));
+    _mm_storeu_ps(outY, _mm_or_ps(_mm_and_ps(nonZero, _mm_mul_ps(dy, invLength)), _mm_andnot_ps(nonZero, dy)));
+    _mm_storeu_ps(outZ, _mm_or_ps(_mm_and_ps(nonZero, _mm_mul_ps(dz, invLength)), _mm_andnot_ps(nonZero, dz)));
+}
+
+RT_TARGET_AVX2 void CameraRayAVX2(const float *columnX, const float *columnY, const float *columnZ, const glm::vec3 &lowerLeft, const glm::vec3 &rowOffset,
+                                  const glm::vec3 &origin, float *outX, float *outY, float *outZ)
+{
+    __m256 zero = _mm256_setzero_ps();
+    __m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(lowerLeft.x), _mm256_loadu_ps(columnX)), _mm256_set1_ps(rowOffset.x)), _mm256_set1_ps(origin.x));
+    __m256 dy = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(lowerLeft.y), _mm256_loadu_ps(columnY)), _mm256_set1_ps(rowOffset.y)), _mm256_set1_ps(origin.y));
+    __m256 dz = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(lowerLeft.z), _mm256_loadu_ps(columnZ)), _mm256_set1_ps(rowOffset.z)), _mm256_set1_ps(origin.z));
+    __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    __m256 invLength = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(dot));
+    __m256 nonZero = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(dx, zero, _CMP_NEQ_UQ), _mm256_cmp_ps(dy, zero, _CMP_NEQ_UQ)), _mm256_cmp_ps(dz, zero, _CMP_NEQ_UQ));
+    _mm256_storeu_ps(outX, _mm256_blendv_ps(dx, _mm256_mul_ps(dx, invLength), nonZero));
+    _mm256_storeu_ps(outY, _mm256_blendv_ps(dy, _mm256_mul_ps(dy, invLength), nonZero));
+    _mm256_storeu_ps(outZ, _mm256_blendv_ps(dz, _mm256_mul_ps(dz, invLength), nonZero));
+}
+#endif
+
+enum ToneMapOperator
+{
+    TONEMAP_CLAMP,    // Clip at 1
+    TONEMAP_REINHARD, // x / (1 + x)
+    TONEMAP_ACES      // Fitted ACES filmic curve
+};
+
+// How linear framebuffer colors are turned into 8-bit values
+struct ToneMapSettings
+{
+    float scale;              // Exposure as a factor, 2^EV
+    ToneMapOperator curve;    // Tone curve applied after the exposure
+    bool srgb;                // Encode with the sRGB transfer curve instead of storing linear values
+};
+
+const int SRGB_TABLE_SIZE = 4096; // Entries of the sRGB encoding table over [0, 1]
+
+/**
+ * @brief sRGB-encoded 8-bit values of the linear intensities i / (SRGB_TABLE_SIZE - 1). Stored as int so the AVX2
+ * kernel can gather from it.
+ */
+const int *SrgbTable()
+{
+    static const std::vector<int> table = []
+    {
+        std::vector<int> t(SRGB_TABLE_SIZE);
+        for (int i = 0; i < SRGB_TABLE_SIZE; i++)
+        {
+            float linear = i / (float)(SRGB_TABLE_SIZE - 1);
+            float encoded = linear <= 0.0031308f ? linear * 12.92f : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+            t[i] = (int)(encoded * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+/**
+ * Tone map kernels convert count linear color values to 8 bits: scale by the exposure, clip below 0, apply the tone
+ * curve, clip above 1, then either quantize as (int)(v * 255) or look the value up in SrgbTable(). With the default
+ * settings this is exactly the clamp-and-truncate conversion the image used before it had a float framebuffer.
+ */
+typedef void (*ToneMapKernel)(const float *in, unsigned char *out, int count, const ToneMapSettings &settings);
+
+inline float ToneCurve(float v, ToneMapOperator curve)
+{
+    switch (curve)
+    {
+    case TONEMAP_REINHARD:
+        return v / (1.0f + v);
+    case TONEMAP_ACES:
+        return (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+    default:
+        return v;
+    }
+}
+
+void ToneMapScalar(const float *in, unsigned char *out, int count, const ToneMapSettings &settings)
+{
+    const int *table = SrgbTable();
+    for (int i = 0; i < count; i++)
+    {
+        float v = std::max(0.0f, in[i] * settings.scale);
+        v = std::min(ToneCurve(v, settings.curve), 1.0f);
+        out[i] = (unsigned char)(settings.srgb ? table[(int)(v * (SRGB_TABLE_SIZE - 1) + 0.5f)] : (int)(v * 255.0f));
+    }
+}
+
+#if defined(RT_X86)
+inline __m128 ToneCurveSSE(__m128 v, ToneMapOperator curve)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+    switch (curve)
+    {
+    case TONEMAP_REINHARD:
+        return _mm_div_ps(v, _mm_add_ps(one, v));
+    case TONEMAP_ACES:
+        return _mm_div_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), v), _mm_set1_ps(0.03f))),
+                          _mm_add_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), v), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f)));
+    default:
+        return v;
+    }
+}
+
+void ToneMapSSE(const float *in, unsigned char *out, int count, const ToneMapSettings &settings)
+{
+    const int *table = SrgbTable();
+    __m128 scale = _mm_set1_ps(settings.scale);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 v = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), zero);
+        v = _mm_min_ps(ToneCurveSSE(v, settings.curve), one);
+        if (settings.srgb)
+        {
+            alignas(16) int index[4];
+            _mm_store_si128((__m128i *)index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(SRGB_TABLE_SIZE - 1)), _mm_set1_ps(0.5f))));
+            for (int k = 0; k < 4; k++)
+            {
+                out[i + k] = (unsigned char)table[index[k]];
+            }
+        }
+        else
+        {
+            __m128i q = _mm_cvttps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+            q = _mm_packs_epi32(q, q);
+            q = _mm_packus_epi16(q, q);
+            int bytes = _mm_cvtsi128_si32(q);
+            memcpy(out + i, &bytes, 4);
+        }
+    }
+    ToneMapScalar(in + i, out + i, count - i, settings);
+}
+
+RT_TARGET_AVX2 inline __m256 ToneCurveAVX2(__m256 v, ToneMapOperator curve)
+{
+    __m256 one = _mm256_set1_ps(1.0f);
+    switch (curve)
+    {
+    case TONEMAP_REINHARD:
+        return _mm256_div_ps(v, _mm256_add_ps(one, v));
+    case TONEMAP_ACES:
+        return _mm256_div_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), v), _mm256_set1_ps(0.03f))),
+                             _mm256_add_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), v), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f)));
+    default:
+        return v;
+    }
+}
+
+RT_TARGET_AVX2 void ToneMapAVX2(const float *in, unsigned char *out, int count, const ToneMapSettings &settings)
+{
+    const int *table = SrgbTable();
+    __m256 scale = _mm256_set1_ps(settings.scale);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), zero);
+        v = _mm256_min_ps(ToneCurveAVX2(v, settings.curve), one);
+        __m256i q;
+        if (settings.srgb)
+        {
+            __m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(SRGB_TABLE_SIZE - 1)), _mm256_set1_ps(0.5f)));
+            q = _mm256_i32gather_epi32(table, index, 4);
+        }
+        else
+        {
+            q = _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(255.0f)));
+        }
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+    ToneMapScalar(in + i, out + i, count - i, settings);
+}
+#endif
+
+enum SimdLevel
+{
+    SIMD_SCALAR, // One primitive per test
+    SIMD_SSE,    // 4 primitives per test (SSE2)
+    SIMD_AVX2    // 8 primitives per test (AVX2)
+};
+
+/**
+ * @brief Detects the widest kernel supported by the CPU the program runs on
+ */
+SimdLevel DetectSimdLevel()
+{
+#if defined(RT_X86)
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7)
+    {
+        __cpuid(info, 1);
+        bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        if (osSavesAvx && (info[1] & (1 << 5)) != 0)
+        {
+            return SIMD_AVX2;
+        }
+    }
+    return SIMD_SSE;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    return SIMD_SSE;
+#endif
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+// Primitive test kernels picked for a SimdLevel
+struct SimdKernels
+{
+    SimdLevel level;                    // Level the kernels were picked for
+    int width;                          // Primitives per block test
+    TriangleBlockKernel triangleBlock;  // Triangle block test
+    SphereBlockKernel sphereBlock;      // Sphere block test
+    PacketBoxKernel packetBox;          // Packet bounds test
+    CameraRayKernel cameraRays;         // Primary ray directions, width pixels per call
+    ToneMapKernel toneMap;              // Framebuffer to 8-bit conversion
+
+    /**
+     * @brief Picks the kernels for the requested level, falling back to narrower ones if this build lacks them
+     */
+    static SimdKernels Get(SimdLevel level)
+    {
+        SimdKernels kernels;
+        kernels.level = SIMD_SCALAR;
+        kernels.width = 1;
+        kernels.triangleBlock = TriangleBlockScalar;
+        kernels.sphereBlock = SphereBlockScalar;
+        kernels.packetBox = PacketBoxScalar;
+        kernels.cameraRays = CameraRayScalar;
+        kernels.toneMap = ToneMapScalar;
+#if defined(RT_X86)
+        if (level == SIMD_AVX2)
+        {
+            kernels.level = SIMD_AVX2;
+            kernels.width = 8;
+            kernels.triangleBlock = TriangleBlockAVX2;
+            kernels.sphereBlock = SphereBlockAVX2;
+            kernels.packetBox = PacketBoxAVX2;
+            kernels.cameraRays = CameraRayAVX2;
+            kernels.toneMap = ToneMapAVX2;
+        }
+        else if (level == SIMD_SSE)
+        {
+            kernels.level = SIMD_SSE;
+            kernels.width = 4;
+            kernels.triangleBlock = TriangleBlockSSE;
+            kernels.sphereBlock = SphereBlockSSE;
+            kernels.packetBox = PacketBoxSSE;
+            kernels.cameraRays = CameraRaySSE;
+            kernels.toneMap = ToneMapSSE;
+        }
+#endif
+        return kernels;
+    }
+
+    static const char *Name(SimdLevel level)
+    {
+        switch (level)
+        {
+        case SIMD_AVX2:
+            return "avx2";
+        case SIMD_SSE:
+            return "sse";
+        default:
+            return "scalar";
+        }
+    }
+};
+
+/**
+ * @brief Mask with the lowest n bits set, for the valid lanes of a block that runs past the end of a range
+ */
+inline int LaneMask(int n)
+{
+    return n >= 32 ? -1 : (1 << n) - 1;
+}
+
+struct Camera
+{
+    glm::vec3 position;   // Position
+    glm::vec3 lookTarget; // Look target
+    glm::vec3 globalUp;   // Global up-vector
+    float fovY;           // Vertical field of view
+    float focalLength;    // Focal length
+
+    int imageWidth;  // image width
+    int imageHeight; // image height
+};
+
+struct Light
+{
+    glm::vec4 position; // Light position (w = 1 if point light, w = 0 if directional light)
+
+    glm::vec3 ambient;  // Light's ambient intensity
+    glm::vec3 diffuse;  // Light's diffuse intensity
+    glm::vec3 specular; // Light's specular intensity
+
+    // --- Attenuation variables ---
+    float constant;  // Constant factor
+    float linear;    // Linear factor
+    float quadratic; // Quadratic factor
+};
+
+struct IntersectionInfo
+{
+    float t;                      // Distance from the ray's origin to the point of intersection (if there was an intersection).
+    SceneObject *obj;             // Object that the ray intersected with. If this is equal to nullptr, then no intersection occured.
+    const Material *material;     // Material at the point of intersection (if there was an intersection), in Scene::materials
+    glm::vec3 intersectionPoint;  // Point where the intersection occured (if there was an intersection)
+    glm::vec3 intersectionNormal; // Normal vector at the point of intersection (if there was an intersection)
+};
+
+const int BVH_BIN_COUNT = 16;     // Number of bins used when evaluating SAH splits
+const int BVH_STACK_SIZE = 64;    // Traversal stack entries; Build() keeps every leaf shallower than this, so the stack never overflows
+const float BVH_TRAVERSAL_COST = 1.0f; // Cost of visiting an interior node, relative to one primitive test
+const float BVH_REBUILD_COST_RATIO = 1.3f; // Refitted trees whose SAH cost grew past this multiple of the built cost are rebuilt
+
+struct BVHNode
+{
+    AABB bounds;   // Bounds of everything below this node
+    int leftFirst; // Index of the left child (right child is leftFirst + 1) if count is 0, otherwise index of the first primitive
+    int count;     // Number of primitives in this leaf, 0 for interior nodes
+};
+
+// Bounding volume hierarchy built with binned SAH over a list of primitive bounds
+struct BVH
+{
+    std::vector<BVHNode> nodes;   // Flattened node array, the root is nodes[0]
+    std::vector<int> primIndices; // Primitive indices, reordered so that every leaf references a contiguous range
+    std::vector<int> parents;     // Parent of every node, -1 for the root
+    std::vector<int> primLeaves;  // Leaf holding every primitive
+    int batchSize = 1;            // Number of primitives tested at once in a leaf; the SAH cost counts batches, not primitives
+    float buildCost = 0.0f;       // Cost() right after the last Build()
+
+    /**
+     * @brief Builds the hierarchy
+     * @param[in] primBounds Bounding box of every primitive. Leaves reference primitives by their index in this list.
+     */
+    void Build(const std::vector<AABB> &primBounds)
+    {
+        nodes.clear();
+        parents.clear();
+        primIndices.resize(primBounds.size());
+        std::iota(primIndices.begin(), primIndices.end(), 0);
+        primLeaves.assign(primBounds.size(), -1);
+        areaCost = 0.0;
+        buildCost = 0.0f;
+
+        if (primBounds.empty())
+        {
+            return;
+        }
+
+        std::vector<glm::vec3> centroids(primBounds.size());
+        for (size_t i = 0; i < primBounds.size(); i++)
+        {
+            centroids[i] = primBounds[i].Centroid();
+        }
+
+        nodes.reserve(primBounds.size() * 2);
+        parents.reserve(primBounds.size() * 2);
+        BVHNode root;
+        root.leftFirst = 0;
+        root.count = (int)primBounds.size();
+        nodes.push_back(root);
+        parents.push_back(-1);
+
+        // Pending nodes with their depth below the root
+        std::vector<std::pair<int, int>> buildStack;
+        buildStack.push_back(std::make_pair(0, 0));
+        while (!buildStack.empty())
+        {
+            std::pair<int, int> pending = buildStack.back();
+            buildStack.pop_back();
+            Subdivide(pending.first, pending.second, primBounds, centroids, buildStack);
+        }
+
+        for (size_t n = 0; n < nodes.size(); n++)
+        {
+            for (int i = nodes[n].leftFirst; i < nodes[n].leftFirst + nodes[n].count; i++)
+            {
+                primLeaves[primIndices[i]] = (int)n;
+            }
+            areaCost += NodeCost(nodes[n]);
+        }
+        dirty.assign(nodes.size(), 0);
+        buildCost = Cost();
+    }
+
+    /**
+     * @brief Recomputes the bounds of every node above the given primitives, bottom-up, without changing the topology
+     * @param[in] primBounds    Bounding box of every primitive, indexed as in Build()
+     * @param[in] changedPrims  Primitives whose bounds changed since the last Build() or Refit()
+     */
+    void Refit(const std::vector<AABB> &primBounds, const std::vector<int> &changedPrims)
+    {
+        // Mark the path from every changed leaf up to the root, stopping where an earlier path already joined it
+        refitNodes.clear();
+        for (size_t i = 0; i < changedPrims.size(); i++)
+        {
+            for (int n = primLeaves[changedPrims[i]]; n >= 0 && !dirty[n]; n = parents[n])
+            {
+                dirty[n] = 1;
+                refitNodes.push_back(n);
+            }
+        }
+
+        // Children are always stored after their parent, so descending indices visit every child before its parent
+        std::sort(refitNodes.begin(), refitNodes.end(), std::greater<int>());
+        for (size_t i = 0; i < refitNodes.size(); i++)
+        {
+            BVHNode &node = nodes[refitNodes[i]];
+            areaCost -= NodeCost(node);
+            AABB bounds;
+            if (node.count > 0)
+            {
+                for (int p = node.leftFirst; p < node.leftFirst + node.count; p++)
+                {
+                    bounds.Grow(primBounds[primIndices[p]]);
+                }
+            }
+            else
+            {
+                bounds = nodes[node.leftFirst].bounds;
+                bounds.Grow(nodes[node.leftFirst + 1].bounds);
+            }
+            node.bounds = bounds;
+            areaCost += NodeCost(node);
+            dirty[refitNodes[i]] = 0;
+        }
+    }
+
+    /**
+     * @brief SAH cost of the tree. It is not divided by the root's surface area, so that refits which spread the
+     *        primitives out count as a degradation rather than being hidden by the growing root.
+     */
+    float Cost() const
+    {
+        return (float)areaCost;
+    }
+
+    /**
+     * @brief Front-to-back traversal of the hierarchy
+     * @param[in]     ray       Ray to traverse with
+     * @param[in,out] tMax      Current closest distance. Subtrees farther than this are skipped, and leafFunc may shrink it.
+     * @param[in]     leafFunc  Called as leafFunc(first, count, tMax) for every leaf the ray reaches, where [first, first + count)
+     *                          is a range in primIndices. Returning true stops the traversal early.
+     * @return True if leafFunc stopped the traversal
+     */
+    template <typename LeafFunc>
+    bool Traverse(const Ray &ray, float &tMax, LeafFunc leafFunc) const
+    {
+        if (nodes.empty())
+        {
+            return false;
+        }
+
+        glm::vec3 invDir = 1.0f / ray.direction;
+        if (nodes[0].bounds.Intersect(ray.origin, invDir, tMax) == FLT_MAX)
+        {
+            return false;
+        }
+
+        int stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        int nodeIndex = 0;
+        while (true)
+        {
+            const BVHNode &node = nodes[nodeIndex];
+            if (node.count > 0)
+            {
+                if (leafFunc(node.leftFirst, node.count, tMax))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                int nearIndex = node.leftFirst;
+                int farIndex = node.leftFirst + 1;
+                float tNear = nodes[nearIndex].bounds.Intersect(ray.origin, invDir, tMax);
+                float tFar = nodes[farIndex].bounds.Intersect(ray.origin, invDir, tMax);
+                if (tFar < tNear)
+                {
+                    std::swap(nearIndex, farIndex);
+                    std::swap(tNear, tFar);
+                }
+
+                if (tNear != FLT_MAX)
+                {
+                    if (tFar != FLT_MAX)
+                    {
+                        stack[stackSize++] = farIndex;
+                    }
+                    nodeIndex = nearIndex;
+                    continue;
+                }
+            }
+
+            // Pop the next subtree that is still closer than the current hit
+            bool found = false;
+            while (stackSize > 0)
+            {
+                nodeIndex = stack[--stackSize];
+                if (nodes[nodeIndex].bounds.Intersect(ray.origin, invDir, tMax) != FLT_MAX)
+                {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+            {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * @brief Traversal of the hierarchy by a packet of rays sharing one stack. Every node is bounds-tested for all
+     * lanes that are still active, and subtrees that no lane hits are skipped.
+     * @param[in] activeMask  Lanes taking part in the traversal, one bit per lane
+     * @param[in] orderDir    Direction used to pick which child to visit first
+     * @param[in] boxFunc     Called as boxFunc(bounds, mask); returns the lanes of mask whose ray hits bounds
+     * @param[in] leafFunc    Called as leafFunc(first, count, mask) for every leaf hit by the lanes in mask;
+     *                        returns the lanes that are finished and should leave the traversal
+     */
+    template <typename BoxFunc, typename LeafFunc>
+    void TraversePacket(int activeMask, const glm::vec3 &orderDir, BoxFunc boxFunc, LeafFunc leafFunc) const
+    {
+        if (nodes.empty())
+        {
+            return;
+        }
+
+        int stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0 && activeMask != 0)
+        {
+            const BVHNode &node = nodes[stack[--stackSize]];
+            int mask = boxFunc(node.bounds, activeMask);
+            if (mask == 0)
+            {
+                continue;
+            }
+
+            if (node.count > 0)
+            {
+                activeMask &= ~leafFunc(node.leftFirst, node.count, mask);
+            }
+            else
+            {
+                int nearIndex = node.leftFirst;
+                int farIndex = node.leftFirst + 1;
+                if (glm::dot(nodes[nearIndex].bounds.Centroid() - nodes[farIndex].bounds.Centroid(), orderDir) > 0)
+                {
+                    std::swap(nearIndex, farIndex);
+                }
+                stack[stackSize++] = farIndex;
+                stack[stackSize++] = nearIndex;
+            }
+        }
+    }
+
+private:
+    struct Bin
+    {
+        AABB bounds;   // Bounds of the primitives in this bin
+        int count = 0; // Number of primitives in this bin
+    };
+
+    double areaCost = 0.0;       // Sum of NodeCost() over all nodes, kept up to date by Refit()
+    std::vector<char> dirty;     // Scratch flags for Refit(), all zero between calls
+    std::vector<int> refitNodes; // Scratch list of the nodes Refit() visits
+
+    /**
+     * @brief Number of batched primitive tests needed for a leaf of the given size
+     */
+    float Batches(int count) const
+    {
+        return (float)((count + batchSize - 1) / batchSize);
+    }
+
+    /**
+     * @brief Contribution of a node to the SAH cost
+     */
+    double NodeCost(const BVHNode &node) const
+    {
+        return (double)(node.count > 0 ? Batches(node.count) : BVH_TRAVERSAL_COST) * node.bounds.SurfaceArea();
+    }
+
+    /**
+     * @brief Splits a node in two along the cheapest binned SAH plane, or leaves it as a leaf if no split pays off.
+     * Nodes at depth BVH_STACK_SIZE - 1 always stay leaves: a traversal pushes at most one node per level above a
+     * leaf (two for the last level of a packet traversal), so this bounds the stack even when the splits peel off
+     * one primitive at a time.
+     */
+    void Subdivide(int nodeIndex, int depth, const std::vector<AABB> &primBounds, const std::vector<glm::vec3> &centroids, std::vector<std::pair<int, int>> &buildStack)
+    {
+        int first = nodes[nodeIndex].leftFirst;
+        int count = nodes[nodeIndex].count;
+
+        AABB bounds;
+        AABB centroidBounds;
+        for (int i = first; i < first + count; i++)
+        {
+            bounds.Grow(primBounds[primIndices[i]]);
+            centroidBounds.Grow(centroids[primIndices[i]]);
+        }
+        nodes[nodeIndex].bounds = bounds;
+
+        if (count <= 1 || depth >= BVH_STACK_SIZE - 1)
+        {
+            return;
+        }
+
+        int bestAxis = -1;
+        int bestSplit = 0;
+        float bestCost = FLT_MAX;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float minC = centroidBounds.min[axis];
+            float maxC = centroidBounds.max[axis];
+            if (maxC <= minC)
+            {
+                continue;
+            }
+
+            Bin bins[BVH_BIN_COUNT];
+            float scale = BVH_BIN_COUNT / (maxC - minC);
+            for (int i = first; i < first + count; i++)
+            {
+                int b = std::min(BVH_BIN_COUNT - 1, (int)((centroids[primIndices[i]][axis] - minC) * scale));
+                bins[b].count++;
+                bins[b].bounds.Grow(primBounds[primIndices[i]]);
+            }
+
+            // Sweep from both sides to get the cost of every plane between bins
+            float leftArea[BVH_BIN_COUNT - 1];
+            int leftCount[BVH_BIN_COUNT - 1];
+            AABB leftBox;
+            int leftSum = 0;
+            for (int i = 0; i < BVH_BIN_COUNT - 1; i++)
+            {
+                leftSum += bins[i].count;
+                leftBox.Grow(bins[i].bounds);
+                leftCount[i] = leftSum;
+                leftArea[i] = leftBox.SurfaceArea();
+            }
+
+            AABB rightBox;
+            int rightSum = 0;
+            for (int i = BVH_BIN_COUNT - 1; i > 0; i--)
+            {
+                rightSum += bins[i].count;
+                rightBox.Grow(bins[i].bounds);
+                float cost = Batches(leftCount[i - 1]) * leftArea[i - 1] + Batches(rightSum) * rightBox.SurfaceArea();
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        float leafCost = Batches(count) * bounds.SurfaceArea();
+        float splitCost = BVH_TRAVERSAL_COST * bounds.SurfaceArea() + bestCost;
+        if (bestAxis < 0 || splitCost >= leafCost)
+        {
+            return;
+        }
+
+        // Partition the primitive range around the chosen plane
+        float minC = centroidBounds.min[bestAxis];
+        float scale = BVH_BIN_COUNT / (centroidBounds.max[bestAxis] - minC);
+        int *middle = std::partition(primIndices.data() + first, primIndices.data() + first + count, [&](int prim)
+        {
+            return std::min(BVH_BIN_COUNT - 1, (int)((centroids[prim][bestAxis] - minC) * scale)) < bestSplit;
+        });
+        int leftCount = (int)(middle - (primIndices.data() + first));
+        if (leftCount == 0 || leftCount == count)
+        {
+            return;
+        }
+
+        BVHNode left;
+        left.leftFirst = first;
+        left.count = leftCount;
+        BVHNode right;
+        right.leftFirst = first + leftCount;
+        right.count = count - leftCount;
+
+        int leftIndex = (int)nodes.size();
+        nodes.push_back(left);
+        nodes.push_back(right);
+        parents.push_back(nodeIndex);
+        parents.push_back(nodeIndex);
+        nodes[nodeIndex].leftFirst = leftIndex;
+        nodes[nodeIndex].count = 0;
+
+        buildStack.push_back(std::make_pair(leftIndex, depth + 1));
+        buildStack.push_back(std::make_pair(leftIndex + 1, depth + 1));
+    }
+};
+
+// Triangle geometry defined once and shared by any number of MeshInstance objects, with its own BVH in object space
+struct Mesh
+{
+    std::vector<glm::vec3> points;     // Three points per triangle, as loaded
+    BVH bvh;                           // Bottom-level hierarchy over the triangles
+    TriangleSoA triangles;             // Triangles in BVH leaf order, so that a leaf's range in bvh.primIndices is also its range here
+    std::vector<glm::vec3> unitNormals; // Normalized face normal of every entry of triangles
+    SimdKernels kernels;               // Kernels used to test leaves
+
+    /**
+     * @brief Precomputes the triangles and builds the hierarchy. Must be called after points is modified.
+     * @param[in] meshKernels Kernels to test leaves with, normally the scene's
+     */
+    void Build(const SimdKernels &meshKernels)
+    {
+        kernels = meshKernels;
+        size_t count = points.size() / 3;
+        std::vector<TriangleData> data(count);
+        std::vector<AABB> primBounds(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const glm::vec3 *p = &points[3 * i];
+            data[i].A = p[0];
+            data[i].edge1 = p[1] - p[0];
+            data[i].edge2 = p[2] - p[0];
+            data[i].normal = glm::cross(data[i].edge1, data[i].edge2);
+            primBounds[i].Grow(p[0]);
+            primBounds[i].Grow(p[1]);
+            primBounds[i].Grow(p[2]);
+        }
+        bvh.batchSize = kernels.width;
+        bvh.Build(primBounds);
+
+        triangles.Clear();
+        unitNormals.clear();
+        for (size_t p = 0; p < bvh.primIndices.size(); p++)
+        {
+            const TriangleData &tri = data[bvh.primIndices[p]];
+            triangles.Add(tri, bvh.primIndices[p]);
+            unitNormals.push_back(glm::normalize(tri.normal));
+        }
+        triangles.Pad();
+    }
+
+    /**
+     * @brief Bounds of the whole mesh in object space
+     */
+    AABB GetBounds() const
+    {
+        return bvh.nodes.empty() ? AABB() : bvh.nodes[0].bounds;
+    }
+
+    /**
+     * @brief Closest-hit query in object space
+     * @param[in]  ray          Ray in object space. Its direction does not need to be normalized.
+     * @param[in]  tMax         Hits at or beyond this distance are ignored
+     * @param[out] outU         Barycentric coordinate of the hit along edge1
+     * @param[out] outV         Barycentric coordinate of the hit along edge2
+     * @param[out] outTriangle  Index of the hit triangle in triangles
+     * @return Distance to the hit in units of the ray's direction, or a negative number if there is no hit in (0, tMax)
+     */
+    float Intersect(const Ray &ray, float tMax, float &outU, float &outV, int &outTriangle) const
+    {
+        float tClosest = tMax;
+        outTriangle = -1;
+        float tLimit = tMax;
+        bvh.Traverse(ray, tLimit, [&](int first, int count, float &tLeaf)
+        {
+            int end = first + count;
+            for (int i = first; i < end; i += kernels.width)
+            {
+                TriangleBlockResult result;
+                int mask = kernels.triangleBlock(triangles, i, ray, tClosest, result) & LaneMask(end - i);
+                for (int lane = 0; mask != 0; lane++, mask >>= 1)
+                {
+                    if ((mask & 1) && result.t[lane] < tClosest)
+                    {
+                        tClosest = result.t[lane];
+                        outTriangle = i + lane;
+                        outU = result.uNumerator[lane] / result.f[lane];
+                        outV = result.vNumerator[lane] / result.f[lane];
+                    }
+                }
+            }
+            tLeaf = tClosest;
+            return false;
+        });
+        return outTriangle >= 0 ? tClosest : -1.0f;
+    }
+
+    /**
+     * @brief Any-hit query in object space
+     * @param[in] ray   Ray in object space
+     * @param[in] tMax  Only hits closer than this distance count
+     * @return True if any triangle is hit in (0, tMax)
+     */
+    bool Occluded(const Ray &ray, float tMax) const
+    {
+        float tLimit = tMax;
+        return bvh.Traverse(ray, tLimit, [&](int first, int count, float &)
+        {
+            int end = first + count;
+            for (int i = first; i < end; i += kernels.width)
+            {
+                TriangleBlockResult result;
+                if (kernels.triangleBlock(triangles, i, ray, tMax, result) & LaneMask(end - i))
+                {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+};
+
+// Subclass of SceneObject placing a shared Mesh in the scene. Rays are moved into the mesh's object space instead of
+// moving the mesh, so an instance costs a transform and a pointer no matter how large the mesh is.
+struct MeshInstance : public SceneObject
+{
+    const Mesh *mesh;       // Shared geometry, owned by Scene::meshes
+    glm::mat4x3 transform;  // Object to world transform
+
+    glm::mat3 inverseLinear;  // Inverse of the linear part of transform, updated by Precompute()
+    glm::vec3 inverseOffset;  // Translation of the world to object transform, updated by Precompute()
+
+    /**
+     * @brief Moves a world space ray into object space. The direction keeps its scale, so distances along the ray
+     *        are the same in both spaces.
+     */
+    Ray ToObject(const Ray &incomingRay) const
+    {
+        Ray ray;
+        ray.origin = inverseLinear * incomingRay.origin + inverseOffset;
+        ray.direction = inverseLinear * incomingRay.direction;
+        return ray;
+    }
+
+    virtual float IntersectDistance(const Ray &incomingRay, float tMax, float &outU, float &outV, int &outSubId) const
+    {
+        return mesh->Intersect(ToObject(incomingRay), tMax, outU, outV, outSubId);
+    }
+
+    virtual void ComputeSurface(const Ray &incomingRay, const HitRecord &hit, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal) const
+    {
+        outIntersectionPoint = incomingRay.origin + (hit.t * incomingRay.direction);
+        outIntersectionNormal = glm::normalize(glm::transpose(inverseLinear) * mesh->unitNormals[hit.subId]);
+    }
+
+    virtual bool Occluded(const Ray &incomingRay, float tMax) const
+    {
+        return mesh->Occluded(ToObject(incomingRay), tMax);
+    }
+
+    virtual void Precompute()
+    {
+        inverseLinear = glm::inverse(glm::mat3(transform));
+        inverseOffset = -(inverseLinear * transform[3]);
+    }
+
+    virtual AABB GetBounds() const
+    {
+        AABB local = mesh->GetBounds();
+        AABB bounds;
+        if (local.min.x > local.max.x)
+        {
+            return bounds;
+        }
+        for (int corner = 0; corner < 8; corner++)
+        {
+            glm::vec3 p((corner & 1) ? local.max.x : local.min.x, (corner & 2) ? local.max.y : local.min.y, (corner & 4) ? local.max.z : local.min.z);
+            bounds.Grow(transform * glm::vec4(p, 1.0f));
+        }
+        return bounds;
+    }
+};
+
+// Subclass of SceneObject representing a triangle mesh in world space. Faces are three indices into a shared vertex
+// buffer plus an index into Scene::materials, so a face costs 14 bytes instead of a whole Triangle object.
+// Face data is expanded into edges and a normal on the fly while testing, so no per-face precomputed copy is kept.
+struct IndexedMesh : public SceneObject
+{
+    std::vector<glm::vec3> vertices;   // Shared vertex buffer
+    std::vector<uint32_t> indices;     // Three indices into vertices per face, in BVH leaf order after Precompute()
+    std::vector<MaterialId> faceMaterials; // Material of every face, in the same order as the faces
+    BVH bvh;                           // Hierarchy over the faces, built by Precompute()
+
+    size_t FaceCount() const
+    {
+        return indices.size() / 3;
+    }
+
+    /**
+     * @brief Expands a face into the form used by the intersection kernel
+     */
+    TriangleData GetFace(size_t face) const
+    {
+        const uint32_t *f = &indices[3 * face];
+        TriangleData tri;
+        tri.A = vertices[f[0]];
+        tri.edge1 = vertices[f[1]] - tri.A;
+        tri.edge2 = vertices[f[2]] - tri.A;
+        tri.normal = glm::cross(tri.edge1, tri.edge2);
+        return tri;
+    }
+
+    virtual float IntersectDistance(const Ray &incomingRay, float tMax, float &outU, float &outV, int &outSubId) const
+    {
+        float tClosest = tMax;
+        outSubId = -1;
+        float tLimit = tMax;
+        bvh.Traverse(incomingRay, tLimit, [&](int first, int count, float &tLeaf)
+        {
+            for (int face = first; face < first + count; face++)
+            {
+                float u, v;
+                float t = IntersectTriangle(GetFace(face), incomingRay.origin, incomingRay.direction, tClosest, u, v);
+                if (t > 0 && t < tClosest)
+                {
+                    tClosest = t;
+                    outSubId = face;
+                    outU = u;
+                    outV = v;
+                }
+            }
+            tLeaf = tClosest;
+            return false;
+        });
+        return outSubId >= 0 ? tClosest : -1.0f;
+    }
+
+    virtual void ComputeSurface(const Ray &, const HitRecord &hit, glm::vec3 &outIntersectionPoint, glm::vec3 &outIntersectionNormal) const
+    {
+        TriangleData tri = GetFace(hit.subId);
+        outIntersectionPoint = tri.A + (hit.u * tri.edge1) + (hit.v * tri.edge2);
+        outIntersectionNormal = glm::normalize(tri.normal);
+    }
+
+    virtual bool Occluded(const Ray &incomingRay, float tMax) const
+    {
+        float tLimit = tMax;
+        return bvh.Traverse(incomingRay, tLimit, [&](int first, int count, float &)
+        {
+            for (int face = first; face < first + count; face++)
+            {
+                float u, v;
+                if (IntersectTriangle(GetFace(face), incomingRay.origin, incomingRay.direction, tMax, u, v) > 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    /**
+     * @brief Builds the BVH over the faces and reorders the faces into leaf order, so that traversal reads
+     *        consecutive faces instead of going through bvh.primIndices
+     */
+    virtual void Precompute()
+    {
+        size_t faceCount = FaceCount();
+        std::vector<AABB> faceBounds(faceCount);
+        for (size_t face = 0; face < faceCount; face++)
+        {
+            for (int corner = 0; corner < 3; corner++)
+            {
+                faceBounds[face].Grow(vertices[indices[3 * face + corner]]);
+            }
+        }
+        bvh.Build(faceBounds);
+
+        // After the reorder face p sits at position p, which lies in the leaf the face came from
+        std::vector<uint32_t> sortedIndices(indices.size());
+        std::vector<MaterialId> sortedMaterials(faceCount);
+        std::vector<int> sortedLeaves(faceCount);
+        for (size_t p = 0; p < faceCount; p++)
+        {
+            int face = bvh.primIndices[p];
+            std::copy(&indices[3 * face], &indices[3 * face] + 3, &sortedIndices[3 * p]);
+            sortedMaterials[p] = faceMaterials[face];
+            sortedLeaves[p] = bvh.primLeaves[face];
+            bvh.primIndices[p] = (int)p;
+        }
+        indices.swap(sortedIndices);
+        faceMaterials.swap(sortedMaterials);
+        bvh.primLeaves.swap(sortedLeaves);
+    }
+
+    virtual AABB GetBounds() const
+    {
+        return bvh.nodes.empty() ? AABB() : bvh.nodes[0].bounds;
+    }
+
+    virtual MaterialId GetMaterialId(const HitRecord &hit) const
+    {
+        return faceMaterials[hit.subId];
+    }
+};
+
+// What the last Scene::Update() did to the acceleration structure
+struct SceneUpdateStats
+{
+    bool rebuilt = false;       // True if the refitted BVH was too slow to keep and got rebuilt
+    double refitSeconds = 0.0;  // Time spent updating the moved objects and refitting the BVH
+    double rebuildSeconds = 0.0; // Time spent in the most recent full rebuild, which may be from an earlier update
+    float costRatio = 1.0f;     // SAH cost of the refitted BVH relative to its cost when it was built
+};
+
+struct Scene
+{
+    Arena arena;                        // Owns the objects and meshes; they are freed together with the scene
+    std::vector<SceneObject *> objects; // List of all objects in the scene, allocated from arena
+    std::vector<Light> lights;          // List of all lights in the scene
+    std::vector<Mesh *> meshes;         // Geometry shared by the MeshInstance objects, allocated from arena
+    MaterialTable materials;            // Materials of all objects, without duplicates
+    BVH bvh;                            // Acceleration structure over objects, and the top level above the meshes' own BVHs
+
+    // Copies of the objects in BVH leaf order, grouped by type so that leaves can be tested with SIMD kernels.
+    // The primitives of a leaf covering positions [first, first + count) of bvh.primIndices are
+    // [triangleStart[first], triangleStart[first + count]) in triangles, and likewise for the other types.
+    TriangleSoA triangles;          // Triangles
+    SphereSoA spheres;              // Spheres
+    std::vector<int> otherObjects;  // Objects of any other type, tested through the SceneObject interface
+    std::vector<int> triangleStart; // Number of triangles before each position of bvh.primIndices
+    std::vector<int> sphereStart;   // Number of spheres before each position of bvh.primIndices
+    std::vector<int> otherStart;    // Number of other objects before each position of bvh.primIndices
+    std::vector<int> objectSlots;   // Position of every object in triangles, spheres or otherObjects
+    std::vector<AABB> primBounds;   // Bounds of every object, as last given to the BVH
+    SimdKernels kernels;            // Kernels used to test leaves
+    SceneUpdateStats updateStats;   // Result of the last Update()
+
+    /**
+     * @brief Precomputes per-object data and (re)builds the acceleration structure. Must be called after objects is modified.
+     * @param[in] simdLevel Widest primitive kernels to use
+     */
+    void Build(SimdLevel simdLevel = DetectSimdLevel())
+    {
+        kernels = SimdKernels::Get(simdLevel);
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            meshes[i]->Build(kernels);
+        }
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            objects[i]->Precompute();
+        }
+        BuildAcceleration();
+    }
+
+    /**
+     * @brief Brings the scene up to date after some objects moved. Only those objects are precomputed again, and only the
+     *        BVH nodes above them are refitted, unless the refit made the tree too slow to trace and it has to be rebuilt.
+     * @param[in] changed Indices in objects of the objects that changed
+     */
+    void Update(const std::vector<int> &changed)
+    {
+        updateStats.rebuilt = false;
+        updateStats.refitSeconds = 0.0;
+        updateStats.costRatio = 1.0f;
+        if (changed.empty())
+        {
+            return;
+        }
+
+        auto refitStart = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < changed.size(); i++)
+        {
+            int objectId = changed[i];
+            objects[objectId]->Precompute();
+            primBounds[objectId] = objects[objectId]->GetBounds();
+            if (Triangle *triangle = dynamic_cast<Triangle *>(objects[objectId]))
+            {
+                triangles.Set(objectSlots[objectId], triangle->data);
+            }
+            else if (Sphere *sphere = dynamic_cast<Sphere *>(objects[objectId]))
+            {
+                spheres.Set(objectSlots[objectId], sphere->center, sphere->radius);
+            }
+        }
+        bvh.Refit(primBounds, changed);
+        updateStats.costRatio = bvh.buildCost > 0.0f ? bvh.Cost() / bvh.buildCost : 1.0f;
+        updateStats.refitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - refitStart).count();
+
+        if (updateStats.costRatio > BVH_REBUILD_COST_RATIO)
+        {
+            updateStats.rebuilt = true;
+            BuildAcceleration();
+        }
+    }
+
+private:
+    /**
+     * @brief Builds the BVH over the precomputed objects and copies them into the SoA arrays in leaf order
+     */
+    void BuildAcceleration()
+    {
+        auto buildStart = std::chrono::steady_clock::now();
+        primBounds.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            primBounds[i] = objects[i]->GetBounds();
+        }
+        bvh.batchSize = kernels.width;
+        bvh.Build(primBounds);
+
+        triangles.Clear();
+        spheres.Clear();
+        otherObjects.clear();
+        triangleStart.assign(1, 0);
+        sphereStart.assign(1, 0);
+        otherStart.assign(1, 0);
+        objectSlots.resize(objects.size());
+        for (size_t p = 0; p < bvh.primIndices.size(); p++)
+        {
+            int objectId = bvh.primIndices[p];
+            if (Triangle *triangle = dynamic_cast<Triangle *>(objects[objectId]))
+            {
+                objectSlots[objectId] = (int)triangles.objectIds.size();
+                triangles.Add(triangle->data, objectId);
+            }
+            else if (Sphere *sphere = dynamic_cast<Sphere *>(objects[objectId]))
+            {
+                objectSlots[objectId] = (int)spheres.objectIds.size();
+                spheres.Add(sphere->center, sphere->radius, objectId);
+            }
+            else
+            {
+                objectSlots[objectId] = (int)otherObjects.size();
+                otherObjects.push_back(objectId);
+            }
+            triangleStart.push_back((int)triangles.objectIds.size());
+            sphereStart.push_back((int)spheres.objectIds.size());
+            otherStart.push_back((int)otherObjects.size());
+        }
+        triangles.Pad();
+        spheres.Pad();
+        updateStats.rebuildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+    }
+};
+
+struct Image
+{
+    std::vector<unsigned char> data; // Image data
+    int width;                       // Image width
+    int height;                      // Image height
+
+    /**
+     * @brief Constructor
+     * @param[in] w Width
+     * @param[in] h Height
+     */
+    Image(const int &w, const int &h)
+        : width(w), height(h)
+    {
+        data.resize(w * h * 3, 0);
+    }
+};
+
+// Linear RGB colors as traced, three floats per pixel with the top row first. Converted to an Image by ToneMap().
+struct FrameBuffer
+{
+    std::vector<float> data; // Pixel colors
+    int width;               // Width in pixels
+    int height;              // Height in pixels
+
+    /**
+     * @brief Constructor
+     * @param[in] w Width
+     * @param[in] h Height
+     */
+    FrameBuffer(const int &w, const int &h)
+        : width(w), height(h)
+    {
+        data.resize(w * h * 3, 0.0f);
+    }
+
+    /**
+     * @brief Sets the color at the specified pixel location
+     * @param[in] x     X-coordinate of the pixel
+     * @param[in] y     Y-coordinate of the pixel
+     * @param[in] color Pixel color
+     */
+    void SetColor(const int &x, const int &y, const glm::vec3 &color)
+    {
+        int index = (y * width + x) * 3;
+        data[index] = color.r;
+        data[index + 1] = color.g;
+        data[index + 2] = color.b;
+    }
+
+    /**
+     * @brief Copies a block of pixels from another buffer, one row at a time
+     * @param[in] src   Source buffer, read starting at its upper-left corner
+     * @param[in] x0    X-coordinate of the destination block
+     * @param[in] y0    Y-coordinate of the destination block
+     * @param[in] w     Width of the block
+     * @param[in] h     Height of the block
+     */
+    void Blit(const FrameBuffer &src, const int &x0, const int &y0, const int &w, const int &h)
+    {
+        for (int y = 0; y < h; y++)
+        {
+            memcpy(&data[((y0 + y) * width + x0) * 3], &src.data[y * src.width * 3], w * 3 * sizeof(float));
+        }
+    }
+};
+
+// A rendered frame: the traced colors and the 8-bit image tone-mapped from them
+struct Frame
+{
+    FrameBuffer hdr; // Linear colors written by the render tiles
+    Image image;     // Tone-mapped colors written to PNG, PPM and QOI files
+
+    Frame(int w, int h) : hdr(w, h), image(w, h) {}
+};
+
+const float AA_CREASE_COS = 0.9f; // Two triangles of one object form an edge if the cosine between their normals is below this
+
+// Surface hit by the primary ray of a pixel
+struct PixelSurface
+{
+    int primId = -1;                 // Hit object, or -1 for the background
+    int subId = 0;                   // Primitive hit inside the object, as in HitRecord
+    glm::vec3 normal = glm::vec3(0); // Normal at the hit
+
+    /**
+     * @brief Records a primary hit
+     * @param[in] hit   Closest hit of the ray
+     * @param[in] info  Surface at the hit
+     */
+    void Set(const HitRecord &hit, const IntersectionInfo &info)
+    {
+        primId = hit.primId;
+        subId = hit.primId >= 0 ? hit.subId : 0;
+        normal = hit.primId >= 0 ? info.intersectionNormal : glm::vec3(0);
+    }
+
+    /**
+     * @brief Checks for a geometric edge between two pixels: they see different objects, or triangles of one mesh
+     * that meet at a crease or overlap at a silhouette
+     */
+    bool IsEdge(const PixelSurface &other) const
+    {
+        return primId != other.primId || (subId != other.subId && glm::dot(normal, other.normal) < AA_CREASE_COS);
+    }
+};
+
+// Primary surface of every pixel, top row first. The renderers record it while tracing the first sample of every
+// pixel, so that AntiAlias() finds edges without casting the primary rays again.
+struct SurfaceBuffer
+{
+    std::vector<PixelSurface> data; // Surface of every pixel
+    int width;                      // Width in pixels
+    int height;                     // Height in pixels
+
+    /**
+     * @brief Constructor
+     * @param[in] w Width
+     * @param[in] h Height
+     */
+    SurfaceBuffer(int w, int h)
+        : width(w), height(h)
+    {
+        data.resize((size_t)w * h);
+    }
+
+    /**
+     * @brief Surface of the specified pixel
+     */
+    PixelSurface &At(int x, int y)
+    {
+        return data[(size_t)y * width + x];
+    }
+};
+
+// File formats frames can be written in
+enum ImageFormat
+{
+    IMAGE_PNG, // PNG (deflate-compressed)
+    IMAGE_PPM, // Binary PPM (raw 8-bit RGB)
+    IMAGE_PFM, // PFM (raw 32-bit float RGB)
+    IMAGE_QOI  // QOI (fast lossless compression)
+};
+
+/**
+ * @brief Gets the ray that goes from the camera's position to the specified pixel at (x, y)
+ * @param[in] camera Camera data
+ * @param[in] x X-coordinate of the pixel (upper-left corner of the pixel)
+ * @param[in] y Y-coordinate of the pixel (upper-left corner of the pixel)
+ * @return Ray that passes through the pixel at (x, y)
+ */
+Ray GetRayThruPixel(const Camera &camera, const int &pixelX, const int &pixelY)
+{
+    Ray ray;
+    ray.origin = camera.position;
+
+    // viewport calculations (slide 17)
+    float aspectRatio = camera.imageWidth / (float)camera.imageHeight;
+    float hViewport = 2 * camera.focalLength * tan((camera.fovY * M_PI / 180) / 2);
+    float wViewport = aspectRatio * hViewport;
+
+    // vector u and vector v calculations (slide 19)
+    glm::vec3 lookDirection = glm::normalize(camera.lookTarget - ray.origin);
     glm::vec3 upVector = glm::cross(lookDirection, camera.globalUp);
     glm::vec3 vVector = glm::cross(upVector, lookDirection);
 
-    if (upVector != glm::vec3(0.0f))
+    if (upVector != glm::vec3(0.0f))
+    {
+        upVector = glm::normalize(upVector);
+    }
+
+    if (vVector != glm::vec3(0.0f))
+    {
+        vVector = glm::normalize(vVector);
+    }
+
+    // lower-left corner point L calculations
+    glm::vec3 L = camera.position + (lookDirection * camera.focalLength) - (upVector * (wViewport / 2)) - (vVector * (hViewport / 2));
+
+    // calculate ray going through pixel (x,y)
+    float s = ((pixelX + 0.5) / camera.imageWidth) * wViewport;
+    float t = ((pixelY + 0.5) / camera.imageHeight) * hViewport;
+    glm::vec3 P = L + upVector * s + vVector * t;
+    glm::vec3 rayDirection = P - ray.origin;
+
+    if (rayDirection != glm::vec3(0.0f))
+    {
+        rayDirection = glm::normalize(rayDirection);
+    }
+
+    ray.direction = rayDirection;
+    return ray;
+}
+
+/**
+ * Primary ray generator for one frame. The camera basis, the viewport and its lower-left corner are computed once,
+ * along with the viewport offset of every pixel column and row, so a ray only costs a few adds and a normalization.
+ * Rays match GetRayThruPixel() bit for bit.
+ */
+struct CameraRayGenerator
+{
+    glm::vec3 origin;                  // Camera position, shared by all rays
+    glm::vec3 lowerLeft;               // Lower-left corner of the viewport
+    std::vector<float> columnX;        // upVector * s of every pixel column (x), padded by SIMD_MAX_WIDTH
+    std::vector<float> columnY;        // upVector * s of every pixel column (y)
+    std::vector<float> columnZ;        // upVector * s of every pixel column (z)
+    std::vector<glm::vec3> rowOffsets; // vVector * t of every pixel row
+    glm::vec3 columnStep;              // Distance between two pixel columns on the viewport
+    glm::vec3 rowStep;                 // Distance between two pixel rows on the viewport
+    CameraRayKernel kernel;            // Direction kernel
+    int width;                         // Pixels per kernel call
+
+    /**
+     * @brief Constructor
+     * @param[in] camera    Camera to generate rays for
+     * @param[in] kernels   Kernels of the scene being rendered
+     */
+    CameraRayGenerator(const Camera &camera, const SimdKernels &kernels)
+        : kernel(kernels.cameraRays), width(kernels.width)
+    {
+        origin = camera.position;
+
+        // viewport calculations (slide 17)
+        float aspectRatio = camera.imageWidth / (float)camera.imageHeight;
+        float hViewport = 2 * camera.focalLength * tan((camera.fovY * M_PI / 180) / 2);
+        float wViewport = aspectRatio * hViewport;
+
+        // vector u and vector v calculations (slide 19)
+        glm::vec3 lookDirection = glm::normalize(camera.lookTarget - origin);
+        glm::vec3 upVector = glm::cross(lookDirection, camera.globalUp);
+        glm::vec3 vVector = glm::cross(upVector, lookDirection);
+
+        if (upVector != glm::vec3(0.0f))
+        {
+            upVector = glm::normalize(upVector);
+        }
+
+        if (vVector != glm::vec3(0.0f))
+        {
+            vVector = glm::normalize(vVector);
+        }
+
+        lowerLeft = camera.position + (lookDirection * camera.focalLength) - (upVector * (wViewport / 2)) - (vVector * (hViewport / 2));
+
+        columnX.assign(camera.imageWidth + SIMD_MAX_WIDTH, 0.0f);
+        columnY.assign(camera.imageWidth + SIMD_MAX_WIDTH, 0.0f);
+        columnZ.assign(camera.imageWidth + SIMD_MAX_WIDTH, 0.0f);
+        for (int pixelX = 0; pixelX < camera.imageWidth; pixelX++)
+        {
+            float s = ((pixelX + 0.5) / camera.imageWidth) * wViewport;
+            glm::vec3 offset = upVector * s;
+            columnX[pixelX] = offset.x;
+            columnY[pixelX] = offset.y;
+            columnZ[pixelX] = offset.z;
+        }
+
+        rowOffsets.resize(camera.imageHeight);
+        for (int pixelY = 0; pixelY < camera.imageHeight; pixelY++)
+        {
+            float t = ((pixelY + 0.5) / camera.imageHeight) * hViewport;
+            rowOffsets[pixelY] = vVector * t;
+        }
+
+        columnStep = upVector * (wViewport / camera.imageWidth);
+        rowStep = vVector * (hViewport / camera.imageHeight);
+    }
+
+    /**
+     * @brief Generates a ray through a point inside a pixel, for anti-aliasing
+     * @param[in] pixelX    Pixel column
+     * @param[in] pixelY    Pixel row (0 is the bottom row)
+     * @param[in] offsetX   Horizontal offset from the pixel center, in pixels (-0.5 to 0.5)
+     * @param[in] offsetY   Vertical offset from the pixel center, in pixels (-0.5 to 0.5, positive is up)
+     * @return Ray through the point
+     */
+    Ray GetSubpixelRay(int pixelX, int pixelY, float offsetX, float offsetY) const
+    {
+        glm::vec3 P = lowerLeft + glm::vec3(columnX[pixelX], columnY[pixelX], columnZ[pixelX]) + columnStep * offsetX + rowOffsets[pixelY] + rowStep * offsetY;
+        Ray ray;
+        ray.origin = origin;
+        ray.direction = P - origin;
+        if (ray.direction != glm::vec3(0.0f))
+        {
+            ray.direction = glm::normalize(ray.direction);
+        }
+        return ray;
+    }
+
+    /**
+     * @brief Generates the rays of a run of pixels in one row, width pixels per kernel call
+     * @param[in]  pixelX   First pixel column
+     * @param[in]  pixelY   Pixel row (0 is the bottom row, as in GetRayThruPixel())
+     * @param[in]  count    Number of pixels, at most imageWidth - pixelX
+     * @param[out] outRays  Ray of every pixel
+     */
+    void GetRays(int pixelX, int pixelY, int count, Ray *outRays) const
+    {
+        alignas(32) float dirX[SIMD_MAX_WIDTH];
+        alignas(32) float dirY[SIMD_MAX_WIDTH];
+        alignas(32) float dirZ[SIMD_MAX_WIDTH];
+        for (int i = 0; i < count; i += width)
+        {
+            kernel(&columnX[pixelX + i], &columnY[pixelX + i], &columnZ[pixelX + i], lowerLeft, rowOffsets[pixelY], origin, dirX, dirY, dirZ);
+            for (int lane = 0; lane < width && i + lane < count; lane++)
+            {
+                outRays[i + lane].origin = origin;
+                outRays[i + lane].direction = glm::vec3(dirX[lane], dirY[lane], dirZ[lane]);
+            }
+        }
+    }
+};
+
+/**
+ * Per-type access to a structure-of-arrays primitive list and its block kernel. IntersectBlocks() and OccludedBlocks()
+ * are instantiated once per type from these, so a new primitive type only needs its own SoA, kernels and traits.
+ */
+struct TriangleTraits
+{
+    typedef TriangleSoA Array;
+    typedef TriangleBlockResult Result;
+
+    static int Test(const SimdKernels &kernels, const Array &prims, int first, const Ray &ray, float tMax, Result &result)
+    {
+        // The scalar kernel is called directly so that it is inlined into the loop instead of called once per primitive
+        return kernels.width == 1 ? TriangleBlockScalar(prims, first, ray, tMax, result) : kernels.triangleBlock(prims, first, ray, tMax, result);
+    }
+
+    static float Distance(const Result &result, int lane)
+    {
+        return result.t[lane];
+    }
+
+    static void Record(const Result &result, int lane, HitRecord &hit)
+    {
+        hit.u = result.uNumerator[lane] / result.f[lane];
+        hit.v = result.vNumerator[lane] / result.f[lane];
+        hit.subId = 0;
+    }
+};
+
+struct SphereTraits
+{
+    typedef SphereSoA Array;
+    struct Result
+    {
+        float t[SIMD_MAX_WIDTH]; // Hit distance of every lane
+    };
+
+    static int Test(const SimdKernels &kernels, const Array &prims, int first, const Ray &ray, float tMax, Result &result)
+    {
+        return kernels.width == 1 ? SphereBlockScalar(prims, first, ray, tMax, result.t) : kernels.sphereBlock(prims, first, ray, tMax, result.t);
+    }
+
+    static float Distance(const Result &result, int lane)
+    {
+        return result.t[lane];
+    }
+
+    static void Record(const Result &, int, HitRecord &hit)
+    {
+        hit.u = 0.0f;
+        hit.v = 0.0f;
+        hit.subId = 0;
+    }
+};
+
+/**
+ * @brief Tests the ray against a range of primitives of one type and keeps the closest hit
+ * @param[in]     ray       Ray to test
+ * @param[in]     prims     Primitives of the type
+ * @param[in]     kernels   Kernels to test with
+ * @param[in]     begin     First primitive to test
+ * @param[in]     end       One past the last primitive to test
+ * @param[in,out] hit       Closest hit so far, replaced by any closer hit
+ */
+template <typename Traits>
+void IntersectBlocks(const Ray &ray, const typename Traits::Array &prims, const SimdKernels &kernels, int begin, int end, HitRecord &hit)
+{
+    for (int i = begin; i < end; i += kernels.width)
+    {
+        typename Traits::Result result;
+        int mask = Traits::Test(kernels, prims, i, ray, hit.t, result) & LaneMask(end - i);
+        for (int lane = 0; mask != 0; lane++, mask >>= 1)
+        {
+            if ((mask & 1) && Traits::Distance(result, lane) < hit.t)
+            {
+                hit.t = Traits::Distance(result, lane);
+                hit.primId = prims.objectIds[i + lane];
+                Traits::Record(result, lane, hit);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Any-hit test of the ray against a range of primitives of one type
+ * @return True if any primitive in [begin, end) is hit in (0, tMax)
+ */
+template <typename Traits>
+bool OccludedBlocks(const Ray &ray, float tMax, const typename Traits::Array &prims, const SimdKernels &kernels, int begin, int end)
+{
+    for (int i = begin; i < end; i += kernels.width)
+    {
+        typename Traits::Result result;
+        if (Traits::Test(kernels, prims, i, ray, tMax, result) & LaneMask(end - i))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Tests the ray against every primitive of a BVH leaf and keeps the closest hit
+ * @param[in]     ray   Ray to test
+ * @param[in]     scene Scene data
+ * @param[in]     first First position of the leaf in bvh.primIndices
+ * @param[in]     count Number of primitives in the leaf
+ * @param[in,out] hit   Closest hit so far, replaced by any closer hit
+ */
+void IntersectLeaf(const Ray &ray, const Scene &scene, int first, int count, HitRecord &hit)
+{
+    IntersectBlocks<TriangleTraits>(ray, scene.triangles, scene.kernels, scene.triangleStart[first], scene.triangleStart[first + count], hit);
+    IntersectBlocks<SphereTraits>(ray, scene.spheres, scene.kernels, scene.sphereStart[first], scene.sphereStart[first + count], hit);
+
+    // Objects without a SoA type go through the SceneObject interface
+    for (int i = scene.otherStart[first]; i < scene.otherStart[first + count]; i++)
+    {
+        int primId = scene.otherObjects[i];
+        float u, v;
+        int subId;
+        float rayDist = scene.objects[primId]->IntersectDistance(ray, hit.t, u, v, subId);
+        if (rayDist > 0 && rayDist < hit.t)
+        {
+            hit.t = rayDist;
+            hit.primId = primId;
+            hit.u = u;
+            hit.v = v;
+            hit.subId = subId;
+        }
+    }
+}
+
+/**
+ * @brief Any-hit test of the ray against the primitives of a BVH leaf
+ * @param[in] ray   Ray to test
+ * @param[in] tMax  Only hits closer than this distance count
+ * @param[in] scene Scene data
+ * @param[in] first First position of the leaf in bvh.primIndices
+ * @param[in] count Number of primitives in the leaf
+ * @return True if any primitive of the leaf is hit in (0, tMax)
+ */
+bool OccludedLeaf(const Ray &ray, float tMax, const Scene &scene, int first, int count)
+{
+    if (OccludedBlocks<TriangleTraits>(ray, tMax, scene.triangles, scene.kernels, scene.triangleStart[first], scene.triangleStart[first + count]) ||
+        OccludedBlocks<SphereTraits>(ray, tMax, scene.spheres, scene.kernels, scene.sphereStart[first], scene.sphereStart[first + count]))
+    {
+        return true;
+    }
+
+    for (int i = scene.otherStart[first]; i < scene.otherStart[first + count]; i++)
+    {
+        if (scene.objects[scene.otherObjects[i]]->Occluded(ray, tMax))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Expands the closest hit of a ray into an IntersectionInfo. Surface attributes are only computed here,
+ * once for the closest hit.
+ * @param[in] ray   Ray that was cast
+ * @param[in] hit   Closest hit of the ray
+ * @param[in] scene Scene object
+ * @return IntersectionInfo of the hit, with obj set to nullptr if nothing was hit
+ */
+IntersectionInfo GetIntersectionInfo(const Ray &ray, const HitRecord &hit, const Scene &scene)
+{
+    IntersectionInfo ret;
+    ret.t = -1.0f;
+    ret.obj = nullptr;
+    ret.material = nullptr;
+    if (hit.primId >= 0)
+    {
+        ret.t = hit.t;
+        ret.obj = scene.objects[hit.primId];
+        ret.obj->ComputeSurface(ray, hit, ret.intersectionPoint, ret.intersectionNormal);
+        ret.material = &scene.materials[ret.obj->GetMaterialId(hit)];
+    }
+    return ret;
+}
+
+// Number of rays cast into the scene
+struct RayCounts
+{
+    long long closest = 0; // Closest-hit queries (primary and reflection rays)
+    long long shadow = 0;  // Any-hit queries (shadow rays)
+};
+
+// Rays cast by the calling thread. RenderImage() collects them from every thread after each tile.
+thread_local RayCounts threadRayCounts;
+
+/**
+ * @brief Finds the closest hit of a ray without computing its surface
+ * @param[in] ray   Ray to cast to the scene
+ * @param[in] scene Scene object
+ * @return Closest hit (primId is -1 if nothing was hit)
+ */
+HitRecord ClosestHit(const Ray &ray, const Scene &scene)
+{
+    threadRayCounts.closest++;
+
+    HitRecord hit;
+    hit.t = FLT_MAX;
+    hit.primId = -1;
+    hit.u = 0.0f;
+    hit.v = 0.0f;
+    hit.subId = 0;
+
+    float tMax = FLT_MAX;
+    scene.bvh.Traverse(ray, tMax, [&](int first, int count, float &tClosest)
+    {
+        IntersectLeaf(ray, scene, first, count, hit);
+        tClosest = hit.t;
+        return false;
+    });
+
+    return hit;
+}
+
+/**
+ * @brief Cast a ray to the scene.
+ * @param[in] ray   Ray to cast to the scene
+ * @param[in] scene Scene object
+ * @return Returns an IntersectionInfo object that will contain the results of the raycast
+ */
+IntersectionInfo Raycast(const Ray &ray, const Scene &scene)
+{
+    return GetIntersectionInfo(ray, ClosestHit(ray, scene), scene);
+}
+
+/**
+ * @brief Checks whether anything in the scene blocks the ray before it travels the given distance.
+ * Stops at the first blocker found, and never computes intersection points or normals.
+ * @param[in] ray   Ray to cast to the scene
+ * @param[in] tMax  Only hits closer than this distance count
+ * @param[in] scene Scene object
+ * @return True if the ray hits any object in (0, tMax)
+ */
+bool Occluded(const Ray &ray, float tMax, const Scene &scene)
+{
+    threadRayCounts.shadow++;
+
+    float tLimit = tMax;
+    return scene.bvh.Traverse(ray, tLimit, [&](int first, int count, float &)
+    {
+        return OccludedLeaf(ray, tMax, scene, first, count);
+    });
+}
+
+/**
+ * @brief Casts all active rays of a packet to the scene together
+ * @param[in,out] packet        Rays to cast. tMax of every lane is lowered to its closest hit.
+ * @param[in]     activeMask    Lanes to cast
+ * @param[in]     scene         Scene object
+ * @param[out]    hits          Closest hit of every lane (primId is -1 for lanes that hit nothing or are inactive)
+ */
+void RaycastPacket(RayPacket &packet, int activeMask, const Scene &scene, HitRecord *hits)
+{
+    threadRayCounts.closest += std::bitset<PACKET_SIZE>(activeMask).count();
+
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        hits[lane].t = packet.tMax[lane];
+        hits[lane].primId = -1;
+        hits[lane].u = 0.0f;
+        hits[lane].v = 0.0f;
+        hits[lane].subId = 0;
+    }
+
+    int firstLane = 0;
+    while (!(activeMask & (1 << firstLane)) && firstLane < PACKET_SIZE - 1)
+    {
+        firstLane++;
+    }
+
+    scene.bvh.TraversePacket(activeMask, packet.rays[firstLane].direction, [&](const AABB &bounds, int mask)
+    {
+        return scene.kernels.packetBox(packet, bounds, mask);
+    },
+    [&](int first, int count, int mask)
+    {
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            if (mask & (1 << lane))
+            {
+                IntersectLeaf(packet.rays[lane], scene, first, count, hits[lane]);
+                packet.tMax[lane] = hits[lane].t;
+            }
+        }
+        return 0;
+    });
+}
+
+/**
+ * @brief Any-hit query for all active rays of a packet. A lane stops traversing as soon as it is occluded.
+ * @param[in] packet        Rays to test, each limited to its tMax
+ * @param[in] activeMask    Lanes to test
+ * @param[in] scene         Scene object
+ * @return Mask of the lanes that hit something in (0, tMax)
+ */
+int OccludedPacket(const RayPacket &packet, int activeMask, const Scene &scene)
+{
+    threadRayCounts.shadow += std::bitset<PACKET_SIZE>(activeMask).count();
+
+    int firstLane = 0;
+    while (!(activeMask & (1 << firstLane)) && firstLane < PACKET_SIZE - 1)
+    {
+        firstLane++;
+    }
+
+    int occluded = 0;
+    scene.bvh.TraversePacket(activeMask, packet.rays[firstLane].direction, [&](const AABB &bounds, int mask)
+    {
+        return scene.kernels.packetBox(packet, bounds, mask);
+    },
+    [&](int first, int count, int mask)
+    {
+        int finished = 0;
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            if ((mask & (1 << lane)) && OccludedLeaf(packet.rays[lane], packet.tMax[lane], scene, first, count))
+            {
+                finished |= 1 << lane;
+            }
+        }
+        occluded |= finished;
+        return finished;
+    });
+    return occluded;
+}
+
+/**
+ * @brief Builds the shadow ray from a hit point towards a light
+ * @param[in]  didRayHit    Hit to shade
+ * @param[in]  light        Light to test
+ * @param[out] outShadow    Shadow ray
+ * @param[out] outDistance  Only occluders closer than this block the light. Directional lights have no position,
+ *                          so anything along the ray blocks them; point lights are only blocked by objects in front of the light.
+ * @return False if the light type is unknown and casts no shadow
+ */
+bool GetShadowRay(const IntersectionInfo &didRayHit, const Light &light, Ray &outShadow, float &outDistance)
+{
+    outShadow.origin = didRayHit.intersectionPoint + (didRayHit.intersectionNormal * 0.01f);
+    if (light.position.w == 0.0f)
+    {
+        outShadow.direction = glm::normalize(-glm::vec3(light.position));
+        outDistance = FLT_MAX;
+        return true;
+    }
+    else if (light.position.w == 1.0f)
+    {
+        outShadow.direction = glm::normalize(glm::vec3(light.position) - outShadow.origin);
+        outDistance = glm::length(glm::vec3(light.position) - didRayHit.intersectionPoint);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Phong lighting of a hit by one light, before shadowing
+ * @param[in]  didRayHit    Hit to shade
+ * @param[in]  light        Light to shade with
+ * @param[in]  camera       Camera data
+ * @param[out] outAmbient   Ambient term (not blocked by shadows)
+ * @param[out] outLit       Diffuse plus specular term (blocked by shadows)
+ */
+void ShadeLight(const IntersectionInfo &didRayHit, const Light &light, const Camera &camera, glm::vec3 &outAmbient, glm::vec3 &outLit)
+{
+    glm::vec3 ambient(0.0f);
+    glm::vec3 diffuse(0.0f);
+    glm::vec3 specular(0.0f);
+    glm::vec3 lightDirection(0.0f);
+    float zeroConst = 0.0f;
+
+    float lightW = light.position.w;
+
+    // Point Light W
+    if (lightW == 1.0f)
+    {
+        // ambient lighting
+        ambient = light.ambient * didRayHit.material->ambient;
+
+        // diffuse lighting
+        glm::vec3 norm = didRayHit.intersectionNormal;
+        lightDirection = glm::normalize(glm::vec3(light.position) - didRayHit.intersectionPoint);
+        float diff = std::max(glm::dot(norm, lightDirection), zeroConst);
+        diffuse = light.diffuse * (diff * didRayHit.material->diffuse);
+
+        // specular lighting
+        glm::vec3 viewDirection = glm::normalize(camera.position - didRayHit.intersectionPoint);
+        lightDirection = glm::normalize(lightDirection);
+        glm::vec3 reflectDirection = glm::reflect(-lightDirection, norm);
+        float spec = pow(std::max(glm::dot(viewDirection, reflectDirection), zeroConst), didRayHit.material->shininess);
+        specular = light.specular * (spec * didRayHit.material->specular);
+
+        // point light attenuation
+        float distance = glm::length(glm::vec3(light.position) - didRayHit.intersectionPoint);
+        float attenuation = 1.0f / (light.constant + light.linear * distance + light.quadratic * pow(distance, 2));
+
+        ambient *= attenuation;
+        diffuse *= attenuation;
+        specular *= attenuation;
+    }
+    else if (lightW == 0.0f)
+    {
+        // Directional Light
+        // ambient lighting
+        ambient = light.ambient * didRayHit.material->ambient;
+
+        // diffuse lighting
+        glm::vec3 norm = didRayHit.intersectionNormal;
+        lightDirection = glm::normalize(-1.0f * glm::vec3(light.position));
+        float diff = std::max(glm::dot(norm, lightDirection), zeroConst);
+        diffuse = diff * (didRayHit.material->diffuse * light.diffuse);
+
+        // specular lighting
+        glm::vec3 viewDirection = glm::normalize(camera.position - didRayHit.intersectionPoint);
+        glm::vec3 reflectDirection = glm::reflect(-lightDirection, norm);
+        float spec = pow(std::max(glm::dot(viewDirection, reflectDirection), zeroConst), didRayHit.material->shininess);
+        specular = light.specular * (spec * didRayHit.material->specular);
+    }
+
+    outAmbient = ambient;
+    outLit = diffuse + specular;
+}
+
+/**
+ * @brief Builds the mirror reflection of a ray at a hit
+ * @param[in] ray       Ray that produced the hit
+ * @param[in] didRayHit Hit to reflect at
+ * @return Reflected ray, offset from the surface to avoid self-intersection
+ */
+Ray GetReflectionRay(const Ray &ray, const IntersectionInfo &didRayHit)
+{
+    Ray reflection;
+    reflection.origin = didRayHit.intersectionPoint + (didRayHit.intersectionNormal * 0.001f);
+    reflection.direction = glm::reflect(ray.direction, didRayHit.intersectionNormal);
+    return reflection;
+}
+
+glm::vec3 ShadeHit(const Ray &ray, const IntersectionInfo &didRayHit, const Scene &scene, const Camera &camera, int maxDepth, const unsigned long long *shadowMask);
+
+/**
+ * @brief Perform a ray-trace to the scene
+ * @param[in] ray       Ray to trace
+ * @param[in] scene     Scene data
+ * @param[in] camera    Camera data
+ * @param[in] maxDepth  Maximum depth of the trace
+ * @param[out] outSurface Receives the surface the ray hit, if not nullptr
+ * @return Resulting color after the ray bounced around the scene
+ */
+glm::vec3 RayTrace(const Ray &ray, const Scene &scene, const Camera &camera, int maxDepth = 1, PixelSurface *outSurface = nullptr)
+{
+    glm::vec3 color(0.0f);
+
+    HitRecord hit = ClosestHit(ray, scene);
+    IntersectionInfo didRayHit = GetIntersectionInfo(ray, hit, scene);
+    if (outSurface != nullptr)
+    {
+        outSurface->Set(hit, didRayHit);
+    }
+    if (didRayHit.obj == nullptr)
+    {
+        return glm::vec3(0.0f);
+    }
+
+    return ShadeHit(ray, didRayHit, scene, camera, maxDepth, nullptr);
+}
+
+/**
+ * @brief Computes the color at a hit: Phong lighting from every light with shadows, plus one reflection
+ * @param[in] ray           Ray that produced the hit
+ * @param[in] didRayHit     Hit to shade
+ * @param[in] scene         Scene data
+ * @param[in] camera        Camera data
+ * @param[in] maxDepth      Maximum depth of the trace
+ * @param[in] shadowMask    Bit i is set if light i is occluded, when shadows were already traced (e.g. as a packet).
+ *                          If nullptr, shadow rays are traced here.
+ * @return Resulting color
+ */
+glm::vec3 ShadeHit(const Ray &ray, const IntersectionInfo &didRayHit, const Scene &scene, const Camera &camera, int maxDepth, const unsigned long long *shadowMask)
+{
+    glm::vec3 color(0.0f);
+    glm::vec3 ambient(0.0f);
+    glm::vec3 lit(0.0f);
+    glm::vec3 colorTemp(0.0f);
+    glm::vec3 colorCombinedTemp(0.0f);
+
+    for (int i = 0; i < scene.lights.size(); i++)
+    {
+        if (didRayHit.obj == nullptr)
+        {
+            color = glm::vec3(0.0f);
+            continue;
+        }
+
+        ShadeLight(didRayHit, scene.lights[i], camera, ambient, lit);
+
+        bool isShadow = false;
+        float shadowVal = 0.0f;
+
+        if (shadowMask != nullptr)
+        {
+            isShadow = ((*shadowMask >> i) & 1) != 0;
+        }
+        else
+        {
+            Ray shadow;
+            float shadowDistance;
+            if (GetShadowRay(didRayHit, scene.lights[i], shadow, shadowDistance))
+            {
+                isShadow = Occluded(shadow, shadowDistance, scene);
+            }
+        }
+
+        if (isShadow)
+        {
+            // std::cout << "shadow" << std::endl;
+            shadowVal = 1.0f;
+        }
+        else
+        {
+            shadowVal = 0.0f;
+        }
+
+        colorTemp = ambient + (1.0f - shadowVal) * lit;
+        colorCombinedTemp += colorTemp;
+    }
+
+    // One reflection per hit, independent of the lights
+    if (didRayHit.obj != nullptr && maxDepth > 0)
+    {
+        Ray reflection = GetReflectionRay(ray, didRayHit);
+        float kr = didRayHit.material->shininess / 128;
+        colorCombinedTemp += (kr * RayTrace(reflection, scene, camera, maxDepth - 1));
+    }
+
+    color = colorCombinedTemp;
+    return color;
+}
+
+/**
+ * @brief Traces a packet of primary rays. Closest hits and shadow rays are traced as packets, then every lane is
+ * shaded on its own. Reflection rays diverge, so they are traced one by one; packets whose rays do not share a
+ * direction octant, and scenes with more than 64 lights, also fall back to single rays.
+ * @param[in,out] packet        Rays to trace (tMax is overwritten)
+ * @param[in]     activeMask    Lanes to trace
+ * @param[in]     scene         Scene data
+ * @param[in]     camera        Camera data
+ * @param[in]     maxDepth      Maximum depth of the trace
+ * @param[out]    outColors     Resulting color of every active lane
+ * @param[out]    outSurfaces   Receives the surface every active lane hit, if not nullptr
+ */
+void RayTracePacket(RayPacket &packet, int activeMask, const Scene &scene, const Camera &camera, int maxDepth, glm::vec3 *outColors, PixelSurface *outSurfaces = nullptr)
+{
+    if (!packet.IsCoherent(activeMask) || scene.lights.size() > 64)
+    {
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            if (activeMask & (1 << lane))
+            {
+                outColors[lane] = RayTrace(packet.rays[lane], scene, camera, maxDepth, outSurfaces != nullptr ? &outSurfaces[lane] : nullptr);
+            }
+        }
+        return;
+    }
+
+    HitRecord hits[PACKET_SIZE];
+    RaycastPacket(packet, activeMask, scene, hits);
+
+    IntersectionInfo infos[PACKET_SIZE];
+    int hitMask = 0;
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        if (activeMask & (1 << lane))
+        {
+            infos[lane] = GetIntersectionInfo(packet.rays[lane], hits[lane], scene);
+            if (outSurfaces != nullptr)
+            {
+                outSurfaces[lane].Set(hits[lane], infos[lane]);
+            }
+            if (infos[lane].obj != nullptr)
+            {
+                hitMask |= 1 << lane;
+            }
+            else
+            {
+                outColors[lane] = glm::vec3(0.0f);
+            }
+        }
+    }
+
+    unsigned long long shadowMasks[PACKET_SIZE] = {};
+    RayPacket shadowPacket = RayPacket();
+    for (size_t i = 0; i < scene.lights.size() && hitMask != 0; i++)
+    {
+        int shadowActive = 0;
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            Ray shadow;
+            float shadowDistance;
+            if ((hitMask & (1 << lane)) && GetShadowRay(infos[lane], scene.lights[i], shadow, shadowDistance))
+            {
+                shadowPacket.Set(lane, shadow, shadowDistance);
+                shadowActive |= 1 << lane;
+            }
+        }
+
+        int occluded = 0;
+        if (shadowPacket.IsCoherent(shadowActive))
+        {
+            occluded = OccludedPacket(shadowPacket, shadowActive, scene);
+        }
+        else
+        {
+            for (int lane = 0; lane < PACKET_SIZE; lane++)
+            {
+                if ((shadowActive & (1 << lane)) && Occluded(shadowPacket.rays[lane], shadowPacket.tMax[lane], scene))
+                {
+                    occluded |= 1 << lane;
+                }
+            }
+        }
+
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            if (occluded & (1 << lane))
+            {
+                shadowMasks[lane] |= 1ull << i;
+            }
+        }
+    }
+
+    for (int lane = 0; lane < PACKET_SIZE; lane++)
+    {
+        if (hitMask & (1 << lane))
+        {
+            outColors[lane] = ShadeHit(packet.rays[lane], infos[lane], scene, camera, maxDepth, &shadowMasks[lane]);
+        }
+    }
+}
+
+// One bounce of the wavefront renderer: rays and everything the stages leave for the final gather, as
+// structure-of-arrays queues
+struct RayQueue
+{
+    std::vector<glm::vec3> origins;    // Ray origins
+    std::vector<glm::vec3> directions; // Ray directions
+    std::vector<HitRecord> hits;       // Closest hit of every ray
+    std::vector<glm::vec3> colors;     // Gathered color of every ray
+
+    // --- Compacted to the rays that hit something ---
+    std::vector<int> hitRays;                // Index of the ray
+    std::vector<IntersectionInfo> surfaces;  // Surface at the hit
+    std::vector<int> firstChild;             // Index of the first reflection ray spawned in the next bounce
+
+    // --- One entry per (hit, light) pair, lights.size() pairs per hit ---
+    std::vector<glm::vec3> ambient; // Ambient term
+    std::vector<glm::vec3> lit;     // Diffuse plus specular term
+    std::vector<char> shadowed;     // Whether the light is occluded
+
+    /**
+     * @brief Empties the queue, keeping its memory for the next tile
+     */
+    void Clear()
+    {
+        origins.clear();
+        directions.clear();
+        hits.clear();
+        colors.clear();
+        hitRays.clear();
+        surfaces.clear();
+        firstChild.clear();
+        ambient.clear();
+        lit.clear();
+        shadowed.clear();
+    }
+
+    /**
+     * @brief Appends a ray
+     */
+    void Push(const Ray &ray)
+    {
+        origins.push_back(ray.origin);
+        directions.push_back(ray.direction);
+    }
+
+    /**
+     * @brief Rebuilds ray i from the queue
+     */
+    Ray GetRay(int i) const
+    {
+        Ray ray;
+        ray.origin = origins[i];
+        ray.direction = directions[i];
+        return ray;
+    }
+
+    int Size() const
+    {
+        return (int)origins.size();
+    }
+};
+
+// Shadow rays of one bounce, waiting for the occlusion stage
+struct ShadowQueue
+{
+    std::vector<glm::vec3> origins;    // Ray origins
+    std::vector<glm::vec3> directions; // Ray directions
+    std::vector<float> tMax;           // Only occluders closer than this block the light
+    std::vector<int> pairs;            // (hit, light) pair in the RayQueue that the ray belongs to
+
+    void Clear()
+    {
+        origins.clear();
+        directions.clear();
+        tMax.clear();
+        pairs.clear();
+    }
+
+    int Size() const
+    {
+        return (int)origins.size();
+    }
+};
+
+/**
+ * Wavefront renderer. Instead of recursing per pixel like RayTrace(), a whole tile moves through the stages together:
+ * generate primary rays, find closest hits, compact to the rays that hit, shade, query shadows and spawn reflections
+ * into the next bounce's queue. Once the last bounce is done, colors are gathered back from the deepest bounce up,
+ * adding every term in the same order as RayTrace() so the images match exactly. The closest-hit and shadow
+ * stages trace their queues in packets of PACKET_SIZE rays wherever the rays are coherent.
+ * Queues keep their memory between tiles, so use one Wavefront per thread.
+ */
+struct Wavefront
+{
+    std::vector<RayQueue> bounces; // Ray queue of every bounce, primary rays first
+    ShadowQueue shadows;           // Shadow rays of the bounce being traced
+    RayPacket packet;              // Scratch packet for the tracing stages
+
+    Wavefront() : packet() {}
+
+    /**
+     * @brief Renders a tile
+     * @param[out] buffer       Tile buffer to write the colors to
+     * @param[in]  scene        Scene data
+     * @param[in]  camera       Camera data
+     * @param[in]  generator    Primary ray generator of the frame
+     * @param[in]  maxDepth     Maximum depth of the trace
+     * @param[in]  x0, y0       Top-left pixel of the tile in the image
+     * @param[in]  w, h         Size of the tile
+     * @param[in]  imageHeight  Height of the whole image
+     * @param[out] surfaces     Receives the primary surface of every pixel of the tile, at its place in the image; may be nullptr
+     */
+    void RenderTile(FrameBuffer &buffer, const Scene &scene, const Camera &camera, const CameraRayGenerator &generator, int maxDepth, int x0, int y0, int w, int h, int imageHeight,
+                    SurfaceBuffer *surfaces)
+    {
+        if ((int)bounces.size() < maxDepth + 1)
+        {
+            bounces.resize(maxDepth + 1);
+        }
+
+        RayQueue &primary = bounces[0];
+        primary.Clear();
+        Ray rays[SIMD_MAX_WIDTH];
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x += SIMD_MAX_WIDTH)
+            {
+                int count = std::min(SIMD_MAX_WIDTH, w - x);
+                generator.GetRays(x0 + x, imageHeight - (y0 + y) - 1, count, rays);
+                for (int i = 0; i < count; i++)
+                {
+                    primary.Push(rays[i]);
+                }
+            }
+        }
+
+        int depth = 0;
+        for (; depth <= maxDepth; depth++)
+        {
+            RayQueue &queue = bounces[depth];
+            FindHits(queue, scene);
+            Shade(queue, scene, camera);
+            QueryShadows(queue, scene);
+            if (depth == maxDepth || queue.hitRays.empty())
+            {
+                break;
+            }
+            bounces[depth + 1].Clear();
+            SpawnReflections(queue, bounces[depth + 1]);
+        }
+
+        for (; depth >= 0; depth--)
+        {
+            Gather(bounces[depth], depth < maxDepth ? &bounces[depth + 1] : nullptr, scene.lights.size());
+        }
+
+        if (surfaces != nullptr)
+        {
+            for (int i = 0; i < primary.Size(); i++)
+            {
+                if (primary.hits[i].primId < 0)
+                {
+                    surfaces->At(x0 + i % w, y0 + i / w).Set(primary.hits[i], IntersectionInfo());
+                }
+            }
+            for (size_t j = 0; j < primary.hitRays.size(); j++)
+            {
+                int i = primary.hitRays[j];
+                surfaces->At(x0 + i % w, y0 + i / w).Set(primary.hits[i], primary.surfaces[j]);
+            }
+        }
+
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                buffer.SetColor(x, y, primary.colors[y * w + x]);
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Closest-hit stage, followed by compaction of the rays that hit something
+     */
+    void FindHits(RayQueue &queue, const Scene &scene)
+    {
+        int count = queue.Size();
+        queue.hits.resize(count);
+        for (int first = 0; first < count; first += PACKET_SIZE)
+        {
+            int activeMask = 0;
+            for (int lane = 0; lane < PACKET_SIZE && first + lane < count; lane++)
+            {
+                packet.Set(lane, queue.GetRay(first + lane), FLT_MAX);
+                activeMask |= 1 << lane;
+            }
+
+            if (packet.IsCoherent(activeMask))
+            {
+                HitRecord hits[PACKET_SIZE];
+                RaycastPacket(packet, activeMask, scene, hits);
+                for (int lane = 0; lane < PACKET_SIZE && first + lane < count; lane++)
+                {
+                    queue.hits[first + lane] = hits[lane];
+                }
+            }
+            else
+            {
+                for (int lane = 0; lane < PACKET_SIZE && first + lane < count; lane++)
+                {
+                    queue.hits[first + lane] = ClosestHit(packet.rays[lane], scene);
+                }
+            }
+        }
+
+        queue.hitRays.clear();
+        for (int i = 0; i < count; i++)
+        {
+            if (queue.hits[i].primId >= 0)
+            {
+                queue.hitRays.push_back(i);
+            }
+        }
+    }
+
+    /**
+     * @brief Shading stage: surface and Phong terms of every (hit, light) pair, and the shadow rays to test
+     */
+    void Shade(RayQueue &queue, const Scene &scene, const Camera &camera)
+    {
+        size_t lightCount = scene.lights.size();
+        size_t hitCount = queue.hitRays.size();
+        queue.surfaces.resize(hitCount);
+        queue.ambient.resize(hitCount * lightCount);
+        queue.lit.resize(hitCount * lightCount);
+        queue.shadowed.assign(hitCount * lightCount, 0);
+        shadows.Clear();
+
+        for (size_t j = 0; j < hitCount; j++)
+        {
+            int i = queue.hitRays[j];
+            queue.surfaces[j] = GetIntersectionInfo(queue.GetRay(i), queue.hits[i], scene);
+            for (size_t l = 0; l < lightCount; l++)
+            {
+                size_t pair = j * lightCount + l;
+                ShadeLight(queue.surfaces[j], scene.lights[l], camera, queue.ambient[pair], queue.lit[pair]);
+
+                Ray shadow;
+                float shadowDistance;
+                if (GetShadowRay(queue.surfaces[j], scene.lights[l], shadow, shadowDistance))
+                {
+                    shadows.origins.push_back(shadow.origin);
+                    shadows.directions.push_back(shadow.direction);
+                    shadows.tMax.push_back(shadowDistance);
+                    shadows.pairs.push_back((int)pair);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Occlusion stage for the shadow rays queued by Shade()
+     */
+    void QueryShadows(RayQueue &queue, const Scene &scene)
+    {
+        int count = shadows.Size();
+        for (int first = 0; first < count; first += PACKET_SIZE)
+        {
+            int activeMask = 0;
+            for (int lane = 0; lane < PACKET_SIZE && first + lane < count; lane++)
+            {
+                Ray shadow;
+                shadow.origin = shadows.origins[first + lane];
+                shadow.direction = shadows.directions[first + lane];
+                packet.Set(lane, shadow, shadows.tMax[first + lane]);
+                activeMask |= 1 << lane;
+            }
+
+            int occluded = 0;
+            if (packet.IsCoherent(activeMask))
+            {
+                occluded = OccludedPacket(packet, activeMask, scene);
+            }
+            else
+            {
+                for (int lane = 0; lane < PACKET_SIZE && first + lane < count; lane++)
+                {
+                    if (Occluded(packet.rays[lane], packet.tMax[lane], scene))
+                    {
+                        occluded |= 1 << lane;
+                    }
+                }
+            }
+
+            for (int lane = 0; lane < PACKET_SIZE && first + lane < count; lane++)
+            {
+                queue.shadowed[shadows.pairs[first + lane]] = (occluded >> lane) & 1;
+            }
+        }
+    }
+
+    /**
+     * @brief Reflection stage: every hit spawns one reflection ray into the next bounce
+     */
+    void SpawnReflections(RayQueue &queue, RayQueue &next)
+    {
+        size_t hitCount = queue.hitRays.size();
+        queue.firstChild.resize(hitCount);
+        for (size_t j = 0; j < hitCount; j++)
+        {
+            queue.firstChild[j] = next.Size();
+            next.Push(GetReflectionRay(queue.GetRay(queue.hitRays[j]), queue.surfaces[j]));
+        }
+    }
+
+    /**
+     * @brief Gather stage: sums the lighting of every ray and the gathered colors of its reflections
+     * @param[in,out] queue     Bounce to gather
+     * @param[in]     next      Already gathered next bounce, or nullptr if queue is the last bounce
+     * @param[in]     lightCount Number of lights in the scene
+     */
+    void Gather(RayQueue &queue, const RayQueue *next, size_t lightCount)
+    {
+        queue.colors.assign(queue.Size(), glm::vec3(0.0f));
+        for (size_t j = 0; j < queue.hitRays.size(); j++)
+        {
+            glm::vec3 colorCombinedTemp(0.0f);
+            for (size_t l = 0; l < lightCount; l++)
+            {
+                size_t pair = j * lightCount + l;
+                float shadowVal = queue.shadowed[pair] ? 1.0f : 0.0f;
+                colorCombinedTemp += queue.ambient[pair] + (1.0f - shadowVal) * queue.lit[pair];
+            }
+            if (next != nullptr)
+            {
+                float kr = queue.surfaces[j].material->shininess / 128;
+                colorCombinedTemp += (kr * next->colors[queue.firstChild[j]]);
+            }
+            queue.colors[queue.hitRays[j]] = colorCombinedTemp;
+        }
+    }
+};
+
+struct RenderOptions
+{
+    int threadCount; // Number of render threads, including the main thread
+    int tileSize;    // Width and height of a render tile in pixels
+
+    SimdLevel simdLevel;    // Widest primitive kernels to use
+    bool usePackets;        // Trace primary and shadow rays as packets
+    bool useWavefront;      // Render with the wavefront renderer instead of recursing per pixel
+    std::string scenePath;  // Scene file to render
+    int maxDepth;           // Overrides the scene's maximum trace depth if >= 0
+    int frameCount;         // Overrides the scene's frame count if > 0
+    int framesInFlight;     // Frames rendered at the same time, each with its own copy of the scene and share of the threads
+
+    ImageFormat imageFormat; // File format of the frames
+    int pngLevel;            // PNG compression level (higher is smaller and slower)
+    int pngFilter;           // PNG filter type (0 to 4) for every row, or -1 to pick one per row
+    int pngThreads;          // Threads of the PNG encoder; 1 uses stb_image_write, more use the banded encoder
+    ToneMapSettings toneMap; // Conversion of the framebuffer to 8 bits
+    int aaSamples;           // Extra samples traced in pixels that need anti-aliasing, 0 to disable it
+    float aaThreshold;       // Color difference to a neighbor above which a pixel gets extra samples
+    bool progressive;        // Render in passes of increasing resolution (see RenderProgressive())
+    double timeBudget;       // Seconds a progressive frame may take before it is cut short, 0 for no limit
+    bool writePasses;        // Also write the image after every progressive pass
+
+    std::string benchmark;  // Name of the benchmark to run instead of rendering, empty to render
+    int benchmarkObjects;   // Number of objects in the generated benchmark scene
+};
+
+/**
+ * @brief Reads the command-line options
+ * @param[in] argc Argument count
+ * @param[in] argv Argument values
+ * @return Parsed options, with defaults for anything not specified
+ */
+RenderOptions ParseOptions(int argc, char *argv[])
+{
+    RenderOptions options;
+    options.threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    options.tileSize = 64;
+    options.simdLevel = DetectSimdLevel();
+    options.usePackets = true;
+    options.useWavefront = false;
+    options.scenePath = "checkboard.test";
+    options.maxDepth = -1;
+    options.frameCount = 0;
+    options.framesInFlight = 1;
+    options.imageFormat = IMAGE_PNG;
+    options.pngLevel = 8;
+    options.pngFilter = -1;
+    options.pngThreads = 1;
+    options.toneMap.scale = 1.0f;
+    options.toneMap.curve = TONEMAP_CLAMP;
+    options.toneMap.srgb = false;
+    options.aaSamples = 0;
+    options.aaThreshold = 0.1f;
+    options.progressive = false;
+    options.timeBudget = 0.0;
+    options.writePasses = false;
+    options.benchmarkObjects = 10000;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            options.threadCount = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--tile-size" && i + 1 < argc)
+        {
+            options.tileSize = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--simd" && i + 1 < argc)
+        {
+            std::string level = argv[++i];
+            if (level == "scalar")
+            {
+                options.simdLevel = SIMD_SCALAR;
+            }
+            else if (level == "sse")
+            {
+                options.simdLevel = std::min(options.simdLevel, SIMD_SSE);
+            }
+            else if (level != "avx2")
+            {
+                std::cout << "Unknown SIMD level: " << level << std::endl;
+            }
+        }
+        else if (arg == "--packets" && i + 1 < argc)
+        {
+            options.usePackets = std::string(argv[++i]) != "off";
+        }
+        else if (arg == "--wavefront" && i + 1 < argc)
+        {
+            options.useWavefront = std::string(argv[++i]) != "off";
+        }
+        else if (arg == "--max-depth" && i + 1 < argc)
+        {
+            options.maxDepth = std::stoi(argv[++i]);
+        }
+        else if (arg == "--frames" && i + 1 < argc)
+        {
+            options.frameCount = std::stoi(argv[++i]);
+        }
+        else if (arg == "--frames-in-flight" && i + 1 < argc)
+        {
+            options.framesInFlight = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            std::string format = argv[++i];
+            if (format == "png")
+            {
+                options.imageFormat = IMAGE_PNG;
+            }
+            else if (format == "ppm")
+            {
+                options.imageFormat = IMAGE_PPM;
+            }
+            else if (format == "pfm")
+            {
+                options.imageFormat = IMAGE_PFM;
+            }
+            else if (format == "qoi")
+            {
+                options.imageFormat = IMAGE_QOI;
+            }
+            else
+            {
+                std::cout << "Unknown output format: " << format << std::endl;
+            }
+        }
+        else if (arg == "--png-level" && i + 1 < argc)
+        {
+            options.pngLevel = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--png-filter" && i + 1 < argc)
+        {
+            static const char *filterNames[] = {"none", "sub", "up", "average", "paeth"};
+            std::string filter = argv[++i];
+            options.pngFilter = -1;
+            for (int f = 0; f < 5; f++)
+            {
+                if (filter == filterNames[f])
+                {
+                    options.pngFilter = f;
+                }
+            }
+            if (options.pngFilter < 0 && filter != "auto")
+            {
+                std::cout << "Unknown PNG filter: " << filter << std::endl;
+            }
+        }
+        else if (arg == "--png-threads" && i + 1 < argc)
+        {
+            options.pngThreads = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--exposure" && i + 1 < argc)
+        {
+            options.toneMap.scale = std::pow(2.0f, std::stof(argv[++i]));
+        }
+        else if (arg == "--tonemap" && i + 1 < argc)
+        {
+            std::string curve = argv[++i];
+            if (curve == "clamp")
+            {
+                options.toneMap.curve = TONEMAP_CLAMP;
+            }
+            else if (curve == "reinhard")
+            {
+                options.toneMap.curve = TONEMAP_REINHARD;
+            }
+            else if (curve == "aces")
+            {
+                options.toneMap.curve = TONEMAP_ACES;
+            }
+            else
+            {
+                std::cout << "Unknown tone curve: " << curve << std::endl;
+            }
+        }
+        else if (arg == "--srgb" && i + 1 < argc)
+        {
+            options.toneMap.srgb = std::string(argv[++i]) != "off";
+        }
+        else if (arg == "--aa-samples" && i + 1 < argc)
+        {
+            options.aaSamples = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--aa-threshold" && i + 1 < argc)
+        {
+            options.aaThreshold = std::stof(argv[++i]);
+        }
+        else if (arg == "--progressive" && i + 1 < argc)
+        {
+            options.progressive = std::string(argv[++i]) != "off";
+        }
+        else if (arg == "--time-budget" && i + 1 < argc)
+        {
+            options.timeBudget = std::max(0.0, std::stod(argv[++i]) / 1000.0);
+            options.progressive = true;
+        }
+        else if (arg == "--write-passes" && i + 1 < argc)
+        {
+            options.writePasses = std::string(argv[++i]) != "off";
+        }
+        else if (arg == "--scene" && i + 1 < argc)
+        {
+            options.scenePath = argv[++i];
+        }
+        else if (arg == "--bench" && i + 1 < argc)
+        {
+            options.benchmark = argv[++i];
+        }
+        else if (arg == "--bench-objects" && i + 1 < argc)
+        {
+            options.benchmarkObjects = std::max(1, std::stoi(argv[++i]));
+        }
+        else
+        {
+            std::cout << "Unknown option: " << arg << std::endl;
+        }
+    }
+
+    return options;
+}
+
+// Per-thread list of tiles. The owner takes tiles from the front, other threads steal from the back.
+// Aligned to a cache line so that queues of different threads never share one.
+struct alignas(64) TileQueue
+{
+    std::mutex mutex;       // Guards tiles, head and tail
+    std::vector<int> tiles; // Tile indices assigned to this thread
+    int head = 0;           // Next tile for the owner
+    int tail = 0;           // One past the last tile that has not been taken
+};
+
+// Fixed-size thread pool that runs a batch of tiles with work stealing
+struct TileScheduler
+{
+    int threadCount;                              // Number of threads, including the calling thread
+    std::vector<std::thread> workers;             // Helper threads (threadCount - 1 of them)
+    std::unique_ptr<TileQueue[]> queues;          // One queue per thread
+    std::function<void(int, int)> task;           // Task of the current batch, called as task(tile, thread)
+    std::mutex mutex;                             // Guards everything below
+    std::condition_variable startCondition;       // Signalled when a new batch is available
+    std::condition_variable doneCondition;        // Signalled when a helper finishes its part of a batch
+    int generation = 0;                           // Incremented for every batch
+    int busyWorkers = 0;                          // Helpers still working on the current batch
+    bool stopping = false;                        // Set when the pool shuts down
+
+    /**
+     * @brief Constructor. Starts threadCount - 1 helper threads; the calling thread is used as thread 0.
+     * @param[in] count Number of threads
+     */
+    TileScheduler(int count)
+        : threadCount(std::max(1, count)), queues(new TileQueue[std::max(1, count)])
+    {
+        for (int i = 1; i < threadCount; i++)
+        {
+            workers.emplace_back(&TileScheduler::WorkerLoop, this, i);
+        }
+    }
+
+    ~TileScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        startCondition.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+    }
+
+    /**
+     * @brief Runs task(tile, thread) for every tile in [0, tileCount) and waits until all of them are done.
+     * Each thread starts with a contiguous block of tiles and steals from the others once its own block runs out.
+     * @param[in] tileCount Number of tiles
+     * @param[in] tileTask  Task to run for each tile
+     */
+    void Run(int tileCount, const std::function<void(int, int)> &tileTask)
+    {
+        for (int i = 0; i < threadCount; i++)
+        {
+            TileQueue &queue = queues[i];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            int first = (int)((long long)tileCount * i / threadCount);
+            int last = (int)((long long)tileCount * (i + 1) / threadCount);
+            queue.tiles.resize(last - first);
+            std::iota(queue.tiles.begin(), queue.tiles.end(), first);
+            queue.head = 0;
+            queue.tail = last - first;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = tileTask;
+            busyWorkers = threadCount - 1;
+            generation++;
+        }
+        startCondition.notify_all();
+
+        ProcessTiles(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCondition.wait(lock, [this]
+        {
+            return busyWorkers == 0;
+        });
+    }
+
+private:
+    void WorkerLoop(int thread)
+    {
+        int seenGeneration = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                startCondition.wait(lock, [&]
+                {
+                    return stopping || generation != seenGeneration;
+                });
+                if (stopping)
+                {
+                    return;
+                }
+                seenGeneration = generation;
+            }
+
+            ProcessTiles(thread);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                busyWorkers--;
+            }
+            doneCondition.notify_one();
+        }
+    }
+
+    void ProcessTiles(int thread)
+    {
+        int tile;
+        while (PopTile(thread, tile))
+        {
+            task(tile, thread);
+        }
+    }
+
+    /**
+     * @brief Takes the next tile from this thread's own queue, or steals one from another thread
+     * @return False once every queue is empty
+     */
+    bool PopTile(int thread, int &tile)
+    {
+        {
+            TileQueue &own = queues[thread];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.head < own.tail)
+            {
+                tile = own.tiles[own.head++];
+                return true;
+            }
+        }
+
+        for (int i = 1; i < threadCount; i++)
+        {
+            TileQueue &victim = queues[(thread + i) % threadCount];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.head < victim.tail)
+            {
+                tile = victim.tiles[--victim.tail];
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+// Memory a render thread reuses for every tile of every RenderImage() call, so that only the first frame allocates it
+struct RenderScratch
+{
+    Wavefront wavefront;    // Queues of the wavefront renderer
+    FrameBuffer tileBuffer; // Colors of the tile being traced
+
+    RenderScratch() : tileBuffer(0, 0) {}
+};
+
+thread_local RenderScratch renderScratch;
+
+/**
+ * @brief Renders the scene into the framebuffer, split into square tiles that are traced in parallel.
+ * Every thread traces a tile into its own buffer and copies the finished rows into the framebuffer, so
+ * threads only touch the shared framebuffer once per tile row.
+ * @param[out] image        Framebuffer to render into
+ * @param[out] surfaces     Receives the primary surface of every pixel, for AntiAlias(); may be nullptr
+ * @param[in]  scene        Scene data
+ * @param[in]  camera       Camera data
+ * @param[in]  maxDepth     Maximum depth of the trace
+ * @param[in]  scheduler    Thread pool to render with
+ * @param[in]  options      Tile size and which renderer to use
+ * @param[in]  showProgress Print the number of finished tiles while rendering
+ * @return Number of rays cast for the image
+ */
+RayCounts RenderImage(FrameBuffer &image, SurfaceBuffer *surfaces, const Scene &scene, const Camera &camera, int maxDepth, TileScheduler &scheduler, const RenderOptions &options, bool showProgress)
+{
+    int tileSize = options.tileSize;
+    int tilesX = (image.width + tileSize - 1) / tileSize;
+    int tilesY = (image.height + tileSize - 1) / tileSize;
+    int tileCount = tilesX * tilesY;
+
+    CameraRayGenerator generator(camera, scene.kernels);
+    std::atomic<int> tilesDone(0);
+    std::atomic<long long> closestRays(0);
+    std::atomic<long long> shadowRays(0);
+
+    scheduler.Run(tileCount, [&](int tile, int thread)
+    {
+        RenderScratch &scratch = renderScratch;
+        if (scratch.tileBuffer.width != tileSize || scratch.tileBuffer.height != tileSize)
+        {
+            scratch.tileBuffer = FrameBuffer(tileSize, tileSize);
+        }
+        FrameBuffer &buffer = scratch.tileBuffer;
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        int w = std::min(tileSize, image.width - x0);
+        int h = std::min(tileSize, image.height - y0);
+
+        if (options.useWavefront)
+        {
+            scratch.wavefront.RenderTile(buffer, scene, camera, generator, maxDepth, x0, y0, w, h, image.height, surfaces);
+        }
+        else if (options.usePackets)
+        {
+            RayPacket packet = RayPacket();
+            glm::vec3 colors[PACKET_SIZE];
+            PixelSurface laneSurfaces[PACKET_SIZE];
+            Ray rays[PACKET_WIDTH];
+            for (int by = 0; by < h; by += PACKET_HEIGHT)
+            {
+                for (int bx = 0; bx < w; bx += PACKET_WIDTH)
+                {
+                    int activeMask = 0;
+                    int count = std::min(PACKET_WIDTH, w - bx);
+                    for (int row = 0; row < PACKET_HEIGHT && by + row < h; row++)
+                    {
+                        generator.GetRays(x0 + bx, image.height - (y0 + by + row) - 1, count, rays);
+                        for (int x = 0; x < count; x++)
+                        {
+                            int lane = row * PACKET_WIDTH + x;
+                            packet.Set(lane, rays[x], FLT_MAX);
+                            activeMask |= 1 << lane;
+                        }
+                    }
+
+                    RayTracePacket(packet, activeMask, scene, camera, maxDepth, colors, surfaces != nullptr ? laneSurfaces : nullptr);
+                    for (int lane = 0; lane < PACKET_SIZE; lane++)
+                    {
+                        if (activeMask & (1 << lane))
+                        {
+                            buffer.SetColor(bx + lane % PACKET_WIDTH, by + lane / PACKET_WIDTH, colors[lane]);
+                            if (surfaces != nullptr)
+                            {
+                                surfaces->At(x0 + bx + lane % PACKET_WIDTH, y0 + by + lane / PACKET_WIDTH) = laneSurfaces[lane];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        else
+        {
+            Ray rays[SIMD_MAX_WIDTH];
+            for (int y = 0; y < h; y++)
+            {
+                for (int x = 0; x < w; x += SIMD_MAX_WIDTH)
+                {
+                    int count = std::min(SIMD_MAX_WIDTH, w - x);
+                    generator.GetRays(x0 + x, image.height - (y0 + y) - 1, count, rays);
+                    for (int i = 0; i < count; i++)
+                    {
+                        glm::vec3 color = RayTrace(rays[i], scene, camera, maxDepth, surfaces != nullptr ? &surfaces->At(x0 + x + i, y0 + y) : nullptr);
+                        buffer.SetColor(x + i, y, color);
+                    }
+                }
+            }
+        }
+        image.Blit(buffer, x0, y0, w, h);
+
+        closestRays += threadRayCounts.closest;
+        shadowRays += threadRayCounts.shadow;
+        threadRayCounts = RayCounts();
+
+        int done = ++tilesDone;
+        if (showProgress && thread == 0)
+        {
+            std::cout << "Tile: " << std::setfill(' ') << std::setw(5) << done << " / " << std::setfill(' ') << std::setw(5) << tileCount << "\r" << std::flush;
+        }
+    });
+    if (showProgress)
+    {
+        std::cout << "Tile: " << std::setfill(' ') << std::setw(5) << tileCount << " / " << std::setfill(' ') << std::setw(5) << tileCount << std::endl;
+    }
+
+    RayCounts counts;
+    counts.closest = closestRays;
+    counts.shadow = shadowRays;
+    return counts;
+}
+
+// Work done by the adaptive anti-aliasing pass
+struct AntiAliasStats
+{
+    long long refinedPixels = 0; // Pixels that got extra samples
+    long long samples = 0;       // Samples in the image, including the first sample of every pixel
+    bool skipped = false;        // True if the deadline passed before the pixels to refine were found, so none were
+    bool complete = true;        // False if the deadline passed before every marked pixel was refined
+    double seconds = 0.0;        // Time the pass took
+};
+
+/**
+ * @brief Adaptive anti-aliasing of a framebuffer rendered with one sample per pixel. A pixel is refined if there is a
+ * geometric edge (PixelSurface::IsEdge()) between it and one of its four neighbors, or if its color differs from a
+ * neighbor's by more than options.aaThreshold in any channel (both clamped to [0, 1]). Refined pixels trace
+ * options.aaSamples more rays, rounded down to a square subpixel grid, and store the average of all their samples.
+ * The deadline is checked before every row of the edge search and every batch of refined pixels; if it passes during
+ * the edge search, no pixel is refined. Pixels that are not refined before the deadline keep their single sample.
+ * @param[in,out] image     Framebuffer to refine
+ * @param[in]     surfaces  Primary surface of every pixel, recorded when the framebuffer was rendered
+ * @param[in]     scene     Scene data
+ * @param[in]     camera    Camera data
+ * @param[in]     maxDepth  Maximum depth of the trace
+ * @param[in]     scheduler Thread pool to render with
+ * @param[in]     options   Sample count and threshold
+ * @param[in]     deadline  Time after which no more rows are searched and no more pixels are refined
+ * @param[in,out] rays      Rays cast for the image; the rays of this pass are added
+ * @return Number of refined pixels and samples
+ */
+AntiAliasStats AntiAlias(FrameBuffer &image, const SurfaceBuffer &surfaces, const Scene &scene, const Camera &camera, int maxDepth, TileScheduler &scheduler, const RenderOptions &options,
+                         std::chrono::steady_clock::time_point deadline, RayCounts &rays)
+{
+    auto start = std::chrono::steady_clock::now();
+    int width = image.width;
+    int height = image.height;
+    CameraRayGenerator generator(camera, scene.kernels);
+    std::atomic<long long> closestRays(0);
+    std::atomic<long long> shadowRays(0);
+    auto collectRays = [&]
+    {
+        closestRays += threadRayCounts.closest;
+        shadowRays += threadRayCounts.shadow;
+        threadRayCounts = RayCounts();
+    };
+
+    AntiAliasStats stats;
+    stats.samples = (long long)width * height;
+    if (std::chrono::steady_clock::now() >= deadline)
+    {
+        stats.skipped = true;
+        stats.complete = false;
+        return stats;
+    }
+
+    std::atomic<bool> interrupted(false);
+    std::vector<unsigned char> refine((size_t)width * height, 0);
+    scheduler.Run(height, [&](int y, int)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            interrupted = true;
+            return;
+        }
+        const int neighborX[4] = {-1, 1, 0, 0};
+        const int neighborY[4] = {0, 0, -1, 1};
+        for (int x = 0; x < width; x++)
+        {
+            size_t p = (size_t)y * width + x;
+            glm::vec3 color = glm::clamp(glm::vec3(image.data[p * 3], image.data[p * 3 + 1], image.data[p * 3 + 2]), 0.0f, 1.0f);
+            for (int k = 0; k < 4 && !refine[p]; k++)
+            {
+                int nx = x + neighborX[k];
+                int ny = y + neighborY[k];
+                if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+                {
+                    continue;
+                }
+                size_t q = (size_t)ny * width + nx;
+                glm::vec3 neighbor = glm::clamp(glm::vec3(image.data[q * 3], image.data[q * 3 + 1], image.data[q * 3 + 2]), 0.0f, 1.0f);
+                glm::vec3 difference = glm::abs(color - neighbor);
+                float contrast = std::max(difference.x, std::max(difference.y, difference.z));
+                refine[p] = surfaces.data[p].IsEdge(surfaces.data[q]) || contrast > options.aaThreshold;
+            }
+        }
+    });
+    if (interrupted)
+    {
+        stats.skipped = true;
+        stats.complete = false;
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    std::vector<int> pixels;
+    for (size_t p = 0; p < refine.size(); p++)
+    {
+        if (refine[p])
+        {
+            pixels.push_back((int)p);
+        }
+    }
+
+    int side = std::max(1, (int)std::sqrt((float)options.aaSamples));
+    int sampleCount = side * side;
+    const int pixelsPerTask = 64;
+    int taskCount = ((int)pixels.size() + pixelsPerTask - 1) / pixelsPerTask;
+    std::atomic<long long> refinedPixels(0);
+    // Samples are traced one by one: refined pixels sit on silhouettes and sharp reflections, where a packet of
+    // subpixel rays splits up right away and costs more than it saves
+    scheduler.Run(taskCount, [&](int task, int)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            return;
+        }
+        int last = std::min((int)pixels.size(), (task + 1) * pixelsPerTask);
+        for (int i = task * pixelsPerTask; i < last; i++)
+        {
+            int x = pixels[i] % width;
+            int y = pixels[i] / width;
+            glm::vec3 sum(image.data[(size_t)pixels[i] * 3], image.data[(size_t)pixels[i] * 3 + 1], image.data[(size_t)pixels[i] * 3 + 2]);
+            for (int s = 0; s < sampleCount; s++)
+            {
+                float offsetX = (s % side + 0.5f) / side - 0.5f;
+                float offsetY = (s / side + 0.5f) / side - 0.5f;
+                sum += RayTrace(generator.GetSubpixelRay(x, height - y - 1, offsetX, offsetY), scene, camera, maxDepth);
+            }
+            image.SetColor(x, y, sum / (float)(sampleCount + 1));
+        }
+        refinedPixels += last - task * pixelsPerTask;
+        collectRays();
+    });
+
+    rays.closest += closestRays;
+    rays.shadow += shadowRays;
+
+    stats.refinedPixels = refinedPixels;
+    stats.complete = stats.refinedPixels == (long long)pixels.size();
+    stats.samples += stats.refinedPixels * sampleCount;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+const int PROGRESSIVE_TILE_SIZE = 64;    // Tile size of the progressive renderer, a multiple of the coarsest step
+const int PROGRESSIVE_COARSEST_STEP = 8; // Block size of the first progressive pass, in pixels
+
+// Progress of a progressive render
+struct ProgressiveStats
+{
+    int passCount = 0;        // Resolution passes, from one ray per 8x8 block down to one ray per pixel
+    int passesDone = 0;       // Resolution passes finished before the deadline
+    AntiAliasStats antiAlias; // Anti-aliasing pass if it is enabled; skipped unless every resolution pass finished
+};
+
+/**
+ * @brief Renders the scene in passes of increasing resolution. The first pass traces one ray per 8x8 block and fills
+ * the block with its color; every later pass halves the block size, tracing only the pixels that do not have a ray
+ * yet, until every pixel has its own. AntiAlias() then adds extra samples if it is enabled. The framebuffer holds a
+ * complete image after every pass, so the render can stop at any time: after the deadline, the remaining tiles and
+ * anti-aliasing work are skipped and every block keeps the finest result it got. The first pass always runs to the end,
+ * and work already started when the deadline passes (one tile, one row of the edge search or one batch of refined
+ * pixels per thread) is finished.
+ * @param[out]    image     Framebuffer to render into
+ * @param[out]    surfaces  Receives the primary surface of every pixel, for AntiAlias(); may be nullptr if it is disabled
+ * @param[in]     scene     Scene data
+ * @param[in]     camera    Camera data
+ * @param[in]     maxDepth  Maximum depth of the trace
+ * @param[in]     scheduler Thread pool to render with
+ * @param[in]     options   Whether to trace packets, and the anti-aliasing settings
+ * @param[in]     deadline  Time after which no more tiles are traced and no more anti-aliasing work is started
+ * @param[in]     onPass    Called with the framebuffer after every finished pass; may be empty
+ * @param[out]    rays      Rays cast for the image
+ * @return Finished passes and anti-aliasing statistics
+ */
+ProgressiveStats RenderProgressive(FrameBuffer &image, SurfaceBuffer *surfaces, const Scene &scene, const Camera &camera, int maxDepth, TileScheduler &scheduler, const RenderOptions &options,
+                                   std::chrono::steady_clock::time_point deadline, const std::function<void(const FrameBuffer &)> &onPass, RayCounts &rays)
+{
+    int tilesX = (image.width + PROGRESSIVE_TILE_SIZE - 1) / PROGRESSIVE_TILE_SIZE;
+    int tilesY = (image.height + PROGRESSIVE_TILE_SIZE - 1) / PROGRESSIVE_TILE_SIZE;
+    int tileCount = tilesX * tilesY;
+
+    CameraRayGenerator generator(camera, scene.kernels);
+    std::atomic<long long> closestRays(0);
+    std::atomic<long long> shadowRays(0);
+
+    ProgressiveStats stats;
+    for (int step = PROGRESSIVE_COARSEST_STEP; step >= 1; step /= 2)
+    {
+        stats.passCount++;
+    }
+
+    for (int step = PROGRESSIVE_COARSEST_STEP; step >= 1; step /= 2)
+    {
+        bool firstPass = step == PROGRESSIVE_COARSEST_STEP;
+        std::atomic<bool> interrupted(false);
+        scheduler.Run(tileCount, [&](int tile, int)
+        {
+            if (!firstPass && std::chrono::steady_clock::now() >= deadline)
+            {
+                interrupted = true;
+                return;
+            }
+
+            int x0 = (tile % tilesX) * PROGRESSIVE_TILE_SIZE;
+            int y0 = (tile / tilesX) * PROGRESSIVE_TILE_SIZE;
+            int w = std::min(PROGRESSIVE_TILE_SIZE, image.width - x0);
+            int h = std::min(PROGRESSIVE_TILE_SIZE, image.height - y0);
+
+            // Packets of 4x4 rays, step pixels apart
+            RayPacket packet = RayPacket();
+            glm::vec3 colors[PACKET_SIZE];
+            PixelSurface laneSurfaces[PACKET_SIZE];
+            PixelSurface *outSurfaces = surfaces != nullptr ? laneSurfaces : nullptr;
+            for (int by = 0; by < h; by += PACKET_HEIGHT * step)
+            {
+                for (int bx = 0; bx < w; bx += PACKET_WIDTH * step)
+                {
+                    int activeMask = 0;
+                    for (int lane = 0; lane < PACKET_SIZE; lane++)
+                    {
+                        int x = bx + (lane % PACKET_WIDTH) * step;
+                        int y = by + (lane / PACKET_WIDTH) * step;
+                        bool tracedBefore = !firstPass && x % (2 * step) == 0 && y % (2 * step) == 0;
+                        if (x < w && y < h && !tracedBefore)
+                        {
+                            Ray ray;
+                            generator.GetRays(x0 + x, image.height - (y0 + y) - 1, 1, &ray);
+                            packet.Set(lane, ray, FLT_MAX);
+                            activeMask |= 1 << lane;
+                        }
+                    }
+
+                    if (options.usePackets)
+                    {
+                        RayTracePacket(packet, activeMask, scene, camera, maxDepth, colors, outSurfaces);
+                    }
+                    else
+                    {
+                        for (int lane = 0; lane < PACKET_SIZE; lane++)
+                        {
+                            if (activeMask & (1 << lane))
+                            {
+                                colors[lane] = RayTrace(packet.rays[lane], scene, camera, maxDepth, outSurfaces != nullptr ? &outSurfaces[lane] : nullptr);
+                            }
+                        }
+                    }
+
+                    // Every pixel's own ray is traced in exactly one pass, which records its surface
+                    for (int lane = 0; lane < PACKET_SIZE; lane++)
+                    {
+                        if (activeMask & (1 << lane))
+                        {
+                            int x = bx + (lane % PACKET_WIDTH) * step;
+                            int y = by + (lane / PACKET_WIDTH) * step;
+                            if (surfaces != nullptr)
+                            {
+                                surfaces->At(x0 + x, y0 + y) = laneSurfaces[lane];
+                            }
+                            for (int fy = y; fy < std::min(y + step, h); fy++)
+                            {
+                                for (int fx = x; fx < std::min(x + step, w); fx++)
+                                {
+                                    image.SetColor(x0 + fx, y0 + fy, colors[lane]);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            closestRays += threadRayCounts.closest;
+            shadowRays += threadRayCounts.shadow;
+            threadRayCounts = RayCounts();
+        });
+
+        if (interrupted)
+        {
+            break;
+        }
+        stats.passesDone++;
+        if (onPass)
+        {
+            onPass(image);
+        }
+    }
+
+    rays.closest += closestRays;
+    rays.shadow += shadowRays;
+
+    if (options.aaSamples > 0 && surfaces != nullptr)
+    {
+        if (stats.passesDone == stats.passCount)
+        {
+            stats.antiAlias = AntiAlias(image, *surfaces, scene, camera, maxDepth, scheduler, options, deadline, rays);
+        }
+        else
+        {
+            stats.antiAlias.samples = (long long)image.width * image.height;
+            stats.antiAlias.skipped = true;
+            stats.antiAlias.complete = false;
+        }
+        if (!stats.antiAlias.skipped && onPass)
+        {
+            onPass(image);
+        }
+    }
+    return stats;
+}
+
+/**
+ * @brief Converts the framebuffer to 8-bit colors with the tone map kernel, in bands of rows on every thread
+ * @param[in]  hdr          Framebuffer to convert
+ * @param[out] image        Image of the same size
+ * @param[in]  settings     Exposure, tone curve and encoding
+ * @param[in]  kernels      Kernels to convert with
+ * @param[in]  scheduler    Thread pool to convert with
+ */
+void ToneMap(const FrameBuffer &hdr, Image &image, const ToneMapSettings &settings, const SimdKernels &kernels, TileScheduler &scheduler)
+{
+    const int bandRows = 16;
+    int rowSize = hdr.width * 3;
+    int bandCount = (hdr.height + bandRows - 1) / bandRows;
+    scheduler.Run(bandCount, [&](int band, int)
+    {
+        int y0 = band * bandRows;
+        int rows = std::min(bandRows, hdr.height - y0);
+        kernels.toneMap(&hdr.data[(size_t)y0 * rowSize], &image.data[(size_t)y0 * rowSize], rows * rowSize, settings);
+    });
+}
+
+/**
+ * Read-only memory mapping of a whole file. The parser tokenizes straight from the mapping, without copying the
+ * file into strings first.
+ */
+struct MappedFile
+{
+    const char *data = nullptr; // File contents (not null-terminated)
+    size_t size = 0;            // File size in bytes
+
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    /**
+     * @brief Maps a file
+     * @param[in] path  File to map
+     * @return False if the file could not be opened or mapped
+     */
+    bool Open(const std::string &path)
+    {
+        Close();
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize))
+        {
+            Close();
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+        if (size == 0)
+        {
+            return true;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            Close();
+            return false;
+        }
+        data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        size = (size_t)info.st_size;
+        if (size == 0)
+        {
+            close(fd);
+            return true;
+        }
+        void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        data = view == MAP_FAILED ? nullptr : (const char *)view;
+#endif
+        if (data == nullptr)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#if defined(_WIN32)
+        if (data != nullptr)
+        {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr)
+        {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr)
+        {
+            munmap((void *)data, size);
+        }
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE; // File handle
+    HANDLE mapping = nullptr;           // File mapping handle
+#endif
+};
+
+// Keyword token of a scene file (e.g. "sphere"), found between the numbers
+struct SceneKeyword
+{
+    size_t position;       // Number of numeric tokens before the keyword
+    std::string_view text; // Keyword, pointing into the mapped file
+};
+
+// Tokens of one line-aligned chunk of a scene file
+struct SceneChunk
+{
+    std::vector<float> numbers;         // Numeric tokens, in file order
+    std::vector<SceneKeyword> keywords; // Keywords; positions count from the start of the chunk
+    std::string_view badToken;          // First token that is neither a keyword nor a number, if any
+};
+
+/**
+ * @brief Splits [begin, end) into whitespace-separated tokens. Tokens that start with a letter are keywords, all
+ * others are parsed as floats with std::from_chars.
+ * @param[in]  begin    First character of the chunk
+ * @param[in]  end      One past the last character of the chunk
+ * @param[out] chunk    Tokens of the chunk
+ */
+inline bool IsSceneSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+/**
+ * @brief Parses a number token. Plain decimals with at most 7 significant digits (almost every token of a .test
+ * file) take a fast path: the digits and the power of ten are both exact floats, so one division gives the
+ * correctly rounded value, the same as std::from_chars. Everything else goes through std::from_chars.
+ * @param[in]  first    First character of the token
+ * @param[in]  last     One past the last character of the token
+ * @param[out] outValue Parsed value
+ * @return False if the token is not a number
+ */
+bool ParseSceneNumber(const char *first, const char *last, float &outValue)
+{
+    static const float powersOfTen[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+    // from_chars does not take a leading '+', which std::stof accepted
+    const char *c = (first < last && *first == '+') ? first + 1 : first;
+    bool negative = c < last && *c == '-';
+    const char *digits = negative ? c + 1 : c;
+
+    unsigned int mantissa = 0;
+    int digitCount = 0;
+    int fractionDigits = -1;
+    const char *p = digits;
+    for (; p < last; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digitCount++;
+            fractionDigits += fractionDigits >= 0 ? 1 : 0;
+        }
+        else if (*p == '.' && fractionDigits < 0)
+        {
+            fractionDigits = 0;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (p == last && digitCount > 0 && digitCount <= 7 && fractionDigits <= 10)
+    {
+        float value = (float)mantissa;
+        if (fractionDigits > 0)
+        {
+            value /= powersOfTen[fractionDigits];
+        }
+        outValue = negative ? -value : value;
+        return true;
+    }
+
+    std::from_chars_result result = std::from_chars(c, last, outValue);
+    return result.ec == std::errc() && result.ptr == last;
+}
+
+void TokenizeSceneChunk(const char *begin, const char *end, SceneChunk &chunk)
+{
+    chunk.numbers.reserve((end - begin) / 4);
+    const char *c = begin;
+    while (true)
+    {
+        while (c < end && IsSceneSpace(*c))
+        {
+            c++;
+        }
+        if (c == end)
+        {
+            break;
+        }
+
+        const char *tokenEnd = c;
+        while (tokenEnd < end && !IsSceneSpace(*tokenEnd))
+        {
+            tokenEnd++;
+        }
+
+        if (isalpha((unsigned char)*c))
+        {
+            SceneKeyword keyword;
+            keyword.position = chunk.numbers.size();
+            keyword.text = std::string_view(c, tokenEnd - c);
+            chunk.keywords.push_back(keyword);
+        }
+        else
+        {
+            float value = 0.0f;
+            if (!ParseSceneNumber(c, tokenEnd, value))
+            {
+                if (chunk.badToken.empty())
+                {
+                    chunk.badToken = std::string_view(c, tokenEnd - c);
+                }
+            }
+            chunk.numbers.push_back(value);
+        }
+        c = tokenEnd;
+    }
+}
+
+enum TrackTarget
+{
+    TRACK_CENTER,    // Sphere center
+    TRACK_TRANSLATE, // Offset added to the object's position as loaded (sphere center or all triangle vertices)
+    TRACK_VERTEX_A,  // Triangle vertex A
+    TRACK_VERTEX_B,  // Triangle vertex B
+    TRACK_VERTEX_C   // Triangle vertex C
+};
+
+enum TrackInterpolation
+{
+    TRACK_LINEAR, // Straight lines between keys
+    TRACK_CUBIC   // Catmull-Rom spline through the keys
+};
+
+// Keyframe track animating one property of one object
+struct AnimationTrack
+{
+    int objectIndex;                    // Animated object, index in Scene::objects
+    TrackTarget target;                 // Animated property
+    TrackInterpolation interpolation;   // Interpolation between keys
+    std::vector<float> keyFrames;       // Frame of every key, increasing
+    std::vector<glm::vec3> keyValues;   // Value of every key
+    glm::vec3 basePoints[3];            // Sphere center or triangle vertices as loaded, for TRACK_TRANSLATE
+    size_t segment = 0;                 // Key the last evaluated frame started from, where the next search begins
+};
+
+/**
+ * Keyframe animation of a scene. Evaluate() finds every track's pair of keys for the frame and then interpolates
+ * all tracks of the same interpolation together, in flat structure-of-arrays loops that the compiler vectorizes.
+ * Apply() writes the values into the objects.
+ */
+struct Animation
+{
+    int frameCount = 16;                // Number of frames to render
+    std::vector<AnimationTrack> tracks; // Tracks
+    std::vector<glm::vec3> values;      // Value of every track at the last evaluated frame
+    bool tracksDirty = true;            // Must be set after tracks (or any track's keys or interpolation) changed
+
+    /**
+     * @brief Evaluates every track at a frame. Frames before the first key or after the last key hold that key.
+     * @param[in] frame Frame to evaluate
+     */
+    void Evaluate(float frame)
+    {
+        if (tracksDirty)
+        {
+            tracksDirty = false;
+            values.resize(tracks.size());
+            linear.Clear();
+            cubic.Clear();
+            for (size_t i = 0; i < tracks.size(); i++)
+            {
+                tracks[i].segment = 0;
+                if (tracks[i].interpolation == TRACK_CUBIC)
+                {
+                    cubic.trackIds.push_back((int)i);
+                }
+                else
+                {
+                    linear.trackIds.push_back((int)i);
+                }
+            }
+            linear.Resize();
+            cubic.Resize();
+        }
+
+        for (size_t j = 0; j < linear.trackIds.size(); j++)
+        {
+            AnimationTrack &track = tracks[linear.trackIds[j]];
+            size_t k = FindSegment(track, frame);
+            size_t k2 = std::min(k + 1, track.keyFrames.size() - 1);
+            float along = (k2 > k && frame > track.keyFrames[k]) ? frame - track.keyFrames[k] : 0.0f;
+            float length = k2 > k ? track.keyFrames[k2] - track.keyFrames[k] : 1.0f;
+            linear.Set(j, track.keyValues[k], track.keyValues[k2], along, length);
+        }
+
+        for (size_t j = 0; j < cubic.trackIds.size(); j++)
+        {
+            AnimationTrack &track = tracks[cubic.trackIds[j]];
+            size_t last = track.keyFrames.size() - 1;
+            size_t k = FindSegment(track, frame);
+            size_t k2 = std::min(k + 1, last);
+            float along = (k2 > k && frame > track.keyFrames[k]) ? frame - track.keyFrames[k] : 0.0f;
+            float length = k2 > k ? track.keyFrames[k2] - track.keyFrames[k] : 1.0f;
+            // Frames spanned by the tangent at each end of the segment. A missing neighbor key at either end of the
+            // track repeats the end key one segment length away.
+            float before = k > 0 ? track.keyFrames[k] - track.keyFrames[k - 1] : length;
+            float after = k2 + 1 <= last ? track.keyFrames[k2 + 1] - track.keyFrames[k2] : length;
+            cubic.Set(j, track.keyValues[k > 0 ? k - 1 : 0], track.keyValues[k], track.keyValues[k2], track.keyValues[std::min(k2 + 1, last)],
+                      length / (before + length), length / (length + after), along / length);
+        }
+
+        linear.Evaluate();
+        cubic.Evaluate();
+        linear.Store(values);
+        cubic.Store(values);
+    }
+
+    /**
+     * @brief Writes the last evaluated values into the animated objects
+     * @param[in,out] objects   Objects of the scene
+     * @param[out]    changed   Indices of the objects that were written, each listed once
+     */
+    void Apply(std::vector<SceneObject *> &objects, std::vector<int> &changed) const
+    {
+        changed.clear();
+        for (size_t i = 0; i < tracks.size(); i++)
+        {
+            const AnimationTrack &track = tracks[i];
+            SceneObject *obj = objects[track.objectIndex];
+            const glm::vec3 &value = values[i];
+            switch (track.target)
+            {
+            case TRACK_CENTER:
+                ((Sphere *)obj)->center = value;
+                break;
+            case TRACK_TRANSLATE:
+                if (Sphere *sphere = dynamic_cast<Sphere *>(obj))
+                {
+                    sphere->center = track.basePoints[0] + value;
+                }
+                else if (Triangle *triangle = dynamic_cast<Triangle *>(obj))
+                {
+                    triangle->A = track.basePoints[0] + value;
+                    triangle->B = track.basePoints[1] + value;
+                    triangle->C = track.basePoints[2] + value;
+                }
+                else if (MeshInstance *instance = dynamic_cast<MeshInstance *>(obj))
+                {
+                    instance->transform[3] = track.basePoints[0] + value;
+                }
+                break;
+            case TRACK_VERTEX_A:
+                ((Triangle *)obj)->A = value;
+                break;
+            case TRACK_VERTEX_B:
+                ((Triangle *)obj)->B = value;
+                break;
+            case TRACK_VERTEX_C:
+                ((Triangle *)obj)->C = value;
+                break;
+            }
+            changed.push_back(track.objectIndex);
+        }
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    }
+
+private:
+    /**
+     * @brief Finds the key a track's segment for a frame starts from. Frames usually move forward, so the search
+     * starts from the segment of the previous call.
+     */
+    static size_t FindSegment(AnimationTrack &track, float frame)
+    {
+        const std::vector<float> &frames = track.keyFrames;
+        size_t last = frames.size() - 1;
+        if (track.segment > last || frames[track.segment] > frame)
+        {
+            track.segment = 0;
+        }
+        while (track.segment < last && frames[track.segment + 1] <= frame)
+        {
+            track.segment++;
+        }
+        return track.segment;
+    }
+
+    // Linear segments of one frame, as a + (b - a) * along / length per component
+    struct LinearBatch
+    {
+        std::vector<int> trackIds;
+        std::vector<float> ax, ay, az;  // Start key
+        std::vector<float> dx, dy, dz;  // End key minus start key
+        std::vector<float> along;       // Frames since the start key
+        std::vector<float> length;      // Frames between the keys
+
+        void Clear()
+        {
+            trackIds.clear();
+        }
+
+        void Resize()
+        {
+            size_t count = trackIds.size();
+            ax.resize(count);
+            ay.resize(count);
+            az.resize(count);
+            dx.resize(count);
+            dy.resize(count);
+            dz.resize(count);
+            along.resize(count);
+            length.resize(count);
+        }
+
+        void Set(size_t slot, const glm::vec3 &a, const glm::vec3 &b, float frameAlong, float frameLength)
+        {
+            ax[slot] = a.x;
+            ay[slot] = a.y;
+            az[slot] = a.z;
+            dx[slot] = b.x - a.x;
+            dy[slot] = b.y - a.y;
+            dz[slot] = b.z - a.z;
+            along[slot] = frameAlong;
+            length[slot] = frameLength;
+        }
+
+        void Evaluate()
+        {
+            size_t count = trackIds.size();
+            float *x = ax.data(), *y = ay.data(), *z = az.data();
+            const float *ddx = dx.data(), *ddy = dy.data(), *ddz = dz.data(), *u = along.data(), *l = length.data();
+            for (size_t i = 0; i < count; i++)
+            {
+                x[i] = x[i] + ddx[i] * u[i] / l[i];
+                y[i] = y[i] + ddy[i] * u[i] / l[i];
+                z[i] = z[i] + ddz[i] * u[i] / l[i];
+            }
+        }
+
+        void Store(std::vector<glm::vec3> &values) const
+        {
+            for (size_t i = 0; i < trackIds.size(); i++)
+            {
+                values[trackIds[i]] = glm::vec3(ax[i], ay[i], az[i]);
+            }
+        }
+    };
+
+    // Catmull-Rom segments of one frame, as p1 + t * (c1 + t * (c2 + t * c3)) per component. The tangents are scaled
+    // by the key spacing (non-uniform Catmull-Rom), so that the curve neither overshoots nor changes speed at keys
+    // that are unevenly spaced in time.
+    struct CubicBatch
+    {
+        std::vector<int> trackIds;
+        std::vector<float> p[3];  // p1 per component, replaced by the result
+        std::vector<float> c1[3]; // Linear coefficient
+        std::vector<float> c2[3]; // Quadratic coefficient
+        std::vector<float> c3[3]; // Cubic coefficient
+        std::vector<float> t;     // Position in the segment, in [0, 1]
+
+        void Clear()
+        {
+            trackIds.clear();
+        }
+
+        void Resize()
+        {
+            size_t count = trackIds.size();
+            t.resize(count);
+            for (int c = 0; c < 3; c++)
+            {
+                p[c].resize(count);
+                c1[c].resize(count);
+                c2[c].resize(count);
+                c3[c].resize(count);
+            }
+        }
+
+        /**
+         * @param[in] slot      Slot of the track
+         * @param[in] p0,p3     Keys before and after the segment
+         * @param[in] p1,p2     Keys the segment runs between
+         * @param[in] w1        Segment length over the frames from p0 to p2; the tangent at p1 is w1 * (p2 - p0)
+         * @param[in] w2        Segment length over the frames from p1 to p3; the tangent at p2 is w2 * (p3 - p1)
+         * @param[in] segmentT  Position in the segment, in [0, 1]
+         */
+        void Set(size_t slot, const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3, float w1, float w2, float segmentT)
+        {
+            t[slot] = segmentT;
+            for (int c = 0; c < 3; c++)
+            {
+                // Cubic Hermite segment from p1 to p2 with tangents m1 and m2
+                float m1 = w1 * (p2[c] - p0[c]);
+                float m2 = w2 * (p3[c] - p1[c]);
+                p[c][slot] = p1[c];
+                c1[c][slot] = m1;
+                c2[c][slot] = 3.0f * (p2[c] - p1[c]) - 2.0f * m1 - m2;
+                c3[c][slot] = 2.0f * (p1[c] - p2[c]) + m1 + m2;
+            }
+        }
+
+        void Evaluate()
+        {
+            size_t count = trackIds.size();
+            const float *s = t.data();
+            for (int c = 0; c < 3; c++)
+            {
+                float *v = p[c].data();
+                const float *k1 = c1[c].data(), *k2 = c2[c].data(), *k3 = c3[c].data();
+                for (size_t i = 0; i < count; i++)
+                {
+                    v[i] = v[i] + s[i] * (k1[i] + s[i] * (k2[i] + s[i] * k3[i]));
+                }
+            }
+        }
+
+        void Store(std::vector<glm::vec3> &values) const
+        {
+            for (size_t i = 0; i < trackIds.size(); i++)
+            {
+                values[trackIds[i]] = glm::vec3(p[0][i], p[1][i], p[2][i]);
+            }
+        }
+    };
+
+    LinearBatch linear; // Linear segments of the frame being evaluated
+    CubicBatch cubic;   // Cubic segments of the frame being evaluated
+};
+
+// Scene file settings besides the objects and lights
+struct SceneFile
+{
+    Camera camera;       // Camera
+    int maxDepth;        // Maximum trace depth
+    Animation animation; // Keyframe tracks and frame count
+};
+
+/**
+ * @brief Loads a .test scene file. The file is memory-mapped and split into line-aligned chunks that are tokenized
+ * on the scheduler's threads; the tokens are then merged and turned into objects and lights in file order.
+ * Besides sphere and tri, the object list may define meshes, which do not count as objects, and place instances of them:
+ *   mesh <triangle count> <ax ay az bx by bz cx cy cz per triangle>
+ *   instance <mesh index> <3x4 object to world matrix, row by row> <material>
+ * and indexed meshes, whose faces pick one of the mesh's materials:
+ *   indexedmesh <vertex count> <face count> <material count> <x y z per vertex> <materials> <a b c material per face>
+ * The lights may be followed by animation sections:
+ *   frames <count>
+ *   track <object index> <center|translate|vertexA|vertexB|vertexC> <linear|cubic> <key count>
+ *   <frame> <x> <y> <z>      (once per key, frames increasing)
+ * @param[in]  path         Scene file
+ * @param[in]  scheduler    Thread pool to tokenize with
+ * @param[out] scene        Receives the objects and lights (scene.Build() is left to the caller)
+ * @param[out] file         Camera, trace depth and animated objects
+ * @return False if the file could not be read or is malformed (a message is printed)
+ */
+bool LoadSceneFile(const std::string &path, TileScheduler &scheduler, Scene &scene, SceneFile &file)
+{
+    MappedFile mapped;
+    if (!mapped.Open(path))
+    {
+        std::cout << "Could not open scene file " << path << std::endl;
+        return false;
+    }
+
+    // Line-aligned chunks of about a megabyte, at most a few per thread
+    const size_t chunkBytes = 1 << 20;
+    int chunkCount = (int)std::min<size_t>(mapped.size / chunkBytes + 1, (size_t)scheduler.threadCount * 4);
+    std::vector<const char *> bounds(chunkCount + 1);
+    bounds[0] = mapped.data;
+    bounds[chunkCount] = mapped.data + mapped.size;
+    for (int i = 1; i < chunkCount; i++)
+    {
+        const char *c = std::max(bounds[i - 1], mapped.data + mapped.size * i / chunkCount);
+        while (c < bounds[chunkCount] && *c != '\n')
+        {
+            c++;
+        }
+        bounds[i] = c;
+    }
+
+    std::vector<SceneChunk> chunks(chunkCount);
+    scheduler.Run(chunkCount, [&](int chunk, int)
+    {
+        TokenizeSceneChunk(bounds[chunk], bounds[chunk + 1], chunks[chunk]);
+    });
+
+    // Merge the chunks
+    std::vector<size_t> firstNumber(chunkCount + 1, 0);
+    size_t keywordCount = 0;
+    for (int i = 0; i < chunkCount; i++)
+    {
+        if (!chunks[i].badToken.empty())
+        {
+            std::cout << "Invalid token '" << chunks[i].badToken << "' in " << path << std::endl;
+            return false;
+        }
+        firstNumber[i + 1] = firstNumber[i] + chunks[i].numbers.size();
+        keywordCount += chunks[i].keywords.size();
+    }
+
+    std::vector<float> numbers(firstNumber[chunkCount]);
+    scheduler.Run(chunkCount, [&](int chunk, int)
+    {
+        std::copy(chunks[chunk].numbers.begin(), chunks[chunk].numbers.end(), numbers.begin() + firstNumber[chunk]);
+        std::vector<float>().swap(chunks[chunk].numbers);
+    });
+
+    std::vector<SceneKeyword> keywords;
+    keywords.reserve(keywordCount);
+    for (int i = 0; i < chunkCount; i++)
+    {
+        for (const SceneKeyword &keyword : chunks[i].keywords)
+        {
+            keywords.push_back(keyword);
+            keywords.back().position += firstNumber[i];
+        }
+    }
+
+    // Interpret the tokens in file order
+    size_t next = 0;
+    size_t nextKeyword = 0;
+    bool ok = true;
+    auto read = [&](size_t count) -> const float *
+    {
+        bool keywordInside = nextKeyword < keywords.size() && keywords[nextKeyword].position < next + count;
+        if (!ok || keywordInside || next + count > numbers.size())
+        {
+            ok = false;
+            return nullptr;
+        }
+        const float *values = &numbers[next];
+        next += count;
+        return values;
+    };
+    auto readKeyword = [&]() -> std::string_view
+    {
+        if (!ok || nextKeyword >= keywords.size() || keywords[nextKeyword].position != next)
+        {
+            ok = false;
+            return std::string_view();
+        }
+        return keywords[nextKeyword++].text;
+    };
+
+    auto addMaterial = [&](const float *v, MaterialId &outId) -> bool
+    {
+        Material material;
+        material.ambient = glm::vec3(v[0], v[1], v[2]);
+        material.diffuse = glm::vec3(v[3], v[4], v[5]);
+        material.specular = glm::vec3(v[6], v[7], v[8]);
+        material.shininess = v[9];
+        if (!scene.materials.Add(material, outId))
+        {
+            std::cout << "More than " << MaterialTable::MAX_MATERIALS << " distinct materials in " << path << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    const float *header = read(15);
+    if (header == nullptr)
+    {
+        std::cout << "Incomplete camera settings in " << path << std::endl;
+        return false;
+    }
+    file.camera.imageWidth = (int)header[0];
+    file.camera.imageHeight = (int)header[1];
+    file.camera.position = glm::vec3(header[2], header[3], header[4]);
+    file.camera.lookTarget = glm::vec3(header[5], header[6], header[7]);
+    file.camera.globalUp = glm::vec3(header[8], header[9], header[10]);
+    file.camera.fovY = header[11];
+    file.camera.focalLength = header[12];
+    file.maxDepth = (int)header[13];
+    int numObj = (int)header[14];
+
+    scene.objects.reserve(scene.objects.size() + numObj);
+    for (int i = 0; i < numObj; i++)
+    {
+        std::string_view type = readKeyword();
+        if (type.empty())
+        {
+            std::cout << "Expected object " << i << " of " << numObj << " in " << path << std::endl;
+            return false;
+        }
+
+        if (type == "sphere")
+        {
+            const float *v = read(14);
+            if (v == nullptr)
+            {
+                break;
+            }
+            MaterialId materialId;
+            if (!addMaterial(v + 4, materialId))
+            {
+                return false;
+            }
+            Sphere *sphere = scene.arena.New<Sphere>();
+            sphere->materialId = materialId;
+            sphere->center = glm::vec3(v[0], v[1], v[2]);
+            sphere->radius = v[3];
+            scene.objects.push_back(sphere);
+        }
+        else if (type == "tri")
+        {
+            const float *v = read(19);
+            if (v == nullptr)
+            {
+                break;
+            }
+            MaterialId materialId;
+            if (!addMaterial(v + 9, materialId))
+            {
+                return false;
+            }
+            Triangle *triangle = scene.arena.New<Triangle>();
+            triangle->materialId = materialId;
+            triangle->A = glm::vec3(v[0], v[1], v[2]);
+            triangle->B = glm::vec3(v[3], v[4], v[5]);
+            triangle->C = glm::vec3(v[6], v[7], v[8]);
+            scene.objects.push_back(triangle);
+        }
+        else if (type == "mesh")
+        {
+            const float *triangleCount = read(1);
+            const float *v = triangleCount != nullptr && triangleCount[0] >= 0 ? read(9 * (size_t)triangleCount[0]) : nullptr;
+            if (v == nullptr)
+            {
+                ok = false;
+                break;
+            }
+            Mesh *mesh = scene.arena.New<Mesh>();
+            mesh->points.resize(3 * (size_t)triangleCount[0]);
+            for (size_t p = 0; p < mesh->points.size(); p++)
+            {
+                mesh->points[p] = glm::vec3(v[3 * p], v[3 * p + 1], v[3 * p + 2]);
+            }
+            scene.meshes.push_back(mesh);
+            i--;
+        }
+        else if (type == "instance")
+        {
+            const float *v = read(23);
+            if (v == nullptr)
+            {
+                break;
+            }
+            int meshIndex = (int)v[0];
+            if (meshIndex < 0 || meshIndex >= (int)scene.meshes.size())
+            {
+                std::cout << "Instance of unknown mesh " << meshIndex << " in " << path << std::endl;
+                return false;
+            }
+            MaterialId materialId;
+            if (!addMaterial(v + 13, materialId))
+            {
+                return false;
+            }
+            MeshInstance *instance = scene.arena.New<MeshInstance>();
+            instance->materialId = materialId;
+            instance->mesh = scene.meshes[meshIndex];
+            for (int row = 0; row < 3; row++)
+            {
+                for (int column = 0; column < 4; column++)
+                {
+                    instance->transform[column][row] = v[1 + 4 * row + column];
+                }
+            }
+            scene.objects.push_back(instance);
+        }
+        else if (type == "indexedmesh")
+        {
+            const float *counts = read(3);
+            if (counts == nullptr || counts[0] < 0 || counts[1] < 0 || counts[2] < 1)
+            {
+                ok = false;
+                break;
+            }
+            // Indices are read as floats, which only hold integers exactly up to 2^24
+            if (counts[0] > 16777216.0f || counts[2] > 16777216.0f)
+            {
+                std::cout << "Indexed mesh with more than 2^24 vertices or materials in " << path << std::endl;
+                return false;
+            }
+            size_t vertexCount = (size_t)counts[0];
+            size_t faceCount = (size_t)counts[1];
+            size_t materialCount = (size_t)counts[2];
+            const float *v = read(3 * vertexCount + 10 * materialCount + 4 * faceCount);
+            if (v == nullptr)
+            {
+                break;
+            }
+            const float *m = v + 3 * vertexCount;
+            const float *f = m + 10 * materialCount;
+            for (size_t face = 0; face < faceCount; face++)
+            {
+                const float *index = f + 4 * face;
+                if (index[0] < 0 || index[1] < 0 || index[2] < 0 || index[3] < 0 ||
+                    index[0] >= vertexCount || index[1] >= vertexCount || index[2] >= vertexCount || index[3] >= materialCount)
+                {
+                    std::cout << "Face " << face << " of indexed mesh " << i << " refers to a missing vertex or material in " << path << std::endl;
+                    return false;
+                }
+            }
+
+            std::vector<MaterialId> meshMaterials(materialCount);
+            for (size_t material = 0; material < materialCount; material++)
+            {
+                if (!addMaterial(m + 10 * material, meshMaterials[material]))
+                {
+                    return false;
+                }
+            }
+            IndexedMesh *mesh = scene.arena.New<IndexedMesh>();
+            mesh->vertices.resize(vertexCount);
+            for (size_t vertex = 0; vertex < vertexCount; vertex++)
+            {
+                mesh->vertices[vertex] = glm::vec3(v[3 * vertex], v[3 * vertex + 1], v[3 * vertex + 2]);
+            }
+            mesh->materialId = meshMaterials[0];
+            mesh->indices.resize(3 * faceCount);
+            mesh->faceMaterials.resize(faceCount);
+            for (size_t face = 0; face < faceCount; face++)
+            {
+                const float *index = f + 4 * face;
+                mesh->indices[3 * face] = (uint32_t)index[0];
+                mesh->indices[3 * face + 1] = (uint32_t)index[1];
+                mesh->indices[3 * face + 2] = (uint32_t)index[2];
+                mesh->faceMaterials[face] = meshMaterials[(size_t)index[3]];
+            }
+            scene.objects.push_back(mesh);
+        }
+        else
+        {
+            std::cout << "Unknown object type '" << type << "' in " << path << std::endl;
+            return false;
+        }
+    }
+    if (!ok)
+    {
+        std::cout << "Incomplete object data in " << path << std::endl;
+        return false;
+    }
+
+    // Light Initialization
+    const float *lightNum = read(1);
+    for (int i = 0; lightNum != nullptr && i < (int)lightNum[0]; i++)
+    {
+        const float *v = read(16);
+        if (v == nullptr)
+        {
+            break;
+        }
+        Light light;
+        light.position = glm::vec4(v[0], v[1], v[2], v[3]);
+        light.ambient = glm::vec3(v[4], v[5], v[6]);
+        light.diffuse = glm::vec3(v[7], v[8], v[9]);
+        light.specular = glm::vec3(v[10], v[11], v[12]);
+        light.constant = v[13];
+        light.linear = v[14];
+        light.quadratic = v[15];
+        scene.lights.push_back(light);
+    }
+    if (!ok)
+    {
+        std::cout << "Incomplete light data in " << path << std::endl;
+        return false;
+    }
+
+    // Animation
+    while (nextKeyword < keywords.size())
+    {
+        std::string_view section = readKeyword();
+        if (section == "frames")
+        {
+            const float *v = read(1);
+            if (v == nullptr)
+            {
+                break;
+            }
+            file.animation.frameCount = std::max(1, (int)v[0]);
+        }
+        else if (section == "track")
+        {
+            AnimationTrack track;
+            const float *objectIndex = read(1);
+            std::string_view target = readKeyword();
+            std::string_view interpolation = readKeyword();
+            const float *keyCount = read(1);
+            const float *keys = keyCount != nullptr && keyCount[0] >= 1 ? read(4 * (size_t)keyCount[0]) : nullptr;
+            if (keys == nullptr)
+            {
+                ok = false;
+                break;
+            }
+
+            track.objectIndex = (int)objectIndex[0];
+            if (track.objectIndex < 0 || track.objectIndex >= (int)scene.objects.size())
+            {
+                std::cout << "Track for unknown object " << track.objectIndex << " in " << path << std::endl;
+                return false;
+            }
+            SceneObject *obj = scene.objects[track.objectIndex];
+            Sphere *sphere = dynamic_cast<Sphere *>(obj);
+            Triangle *triangle = dynamic_cast<Triangle *>(obj);
+            MeshInstance *instance = dynamic_cast<MeshInstance *>(obj);
+
+            bool validTarget = true;
+            if (target == "center")
+            {
+                track.target = TRACK_CENTER;
+                validTarget = sphere != nullptr;
+            }
+            else if (target == "translate")
+            {
+                track.target = TRACK_TRANSLATE;
+                validTarget = sphere != nullptr || triangle != nullptr || instance != nullptr;
+            }
+            else if (target == "vertexA" || target == "vertexB" || target == "vertexC")
+            {
+                track.target = target == "vertexA" ? TRACK_VERTEX_A : (target == "vertexB" ? TRACK_VERTEX_B : TRACK_VERTEX_C);
+                validTarget = triangle != nullptr;
+            }
+            else
+            {
+                validTarget = false;
+            }
+            if (!validTarget)
+            {
+                std::cout << "Invalid track target '" << target << "' for object " << track.objectIndex << " in " << path << std::endl;
+                return false;
+            }
+
+            if (interpolation == "linear" || interpolation == "cubic")
+            {
+                track.interpolation = interpolation == "linear" ? TRACK_LINEAR : TRACK_CUBIC;
+            }
+            else
+            {
+                std::cout << "Unknown interpolation '" << interpolation << "' in " << path << std::endl;
+                return false;
+            }
+
+            for (int k = 0; k < (int)keyCount[0]; k++)
+            {
+                const float *key = keys + 4 * k;
+                if (k > 0 && key[0] <= track.keyFrames.back())
+                {
+                    std::cout << "Track keys for object " << track.objectIndex << " are not in increasing frame order in " << path << std::endl;
+                    return false;
+                }
+                track.keyFrames.push_back(key[0]);
+                track.keyValues.push_back(glm::vec3(key[1], key[2], key[3]));
+            }
+
+            if (sphere != nullptr)
+            {
+                track.basePoints[0] = sphere->center;
+            }
+            else if (triangle != nullptr)
+            {
+                track.basePoints[0] = triangle->A;
+                track.basePoints[1] = triangle->B;
+                track.basePoints[2] = triangle->C;
+            }
+            else if (instance != nullptr)
+            {
+                track.basePoints[0] = instance->transform[3];
+            }
+            file.animation.tracks.push_back(track);
+        }
+        else
+        {
+            if (ok)
+            {
+                std::cout << "Unknown section '" << section << "' in " << path << std::endl;
+                return false;
+            }
+            break;
+        }
+    }
+    if (!ok)
+    {
+        std::cout << "Incomplete animation data in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Scene loaded and preprocessed once for a whole animation. Each frame only moves the animated objects and
+ * updates the scene around them.
+ */
+struct RenderSession
+{
+    Scene scene;              // Scene data
+    SceneFile file;           // Camera, trace depth and animation
+    std::vector<int> changed; // Objects moved by the last frame update
+
+    RenderSession() {}
+    RenderSession(const RenderSession &) = delete;
+    RenderSession &operator=(const RenderSession &) = delete;
+
+    /**
+     * @brief Loads the scene file and builds the scene
+     * @param[in] path          Scene file
+     * @param[in] scheduler     Thread pool to load with
+     * @param[in] simdLevel     Widest primitive kernels to use
+     * @return False if the file could not be loaded
+     */
+    bool Load(const std::string &path, TileScheduler &scheduler, SimdLevel simdLevel)
+    {
+        if (!LoadSceneFile(path, scheduler, scene, file))
+        {
+            return false;
+        }
+        scene.Build(simdLevel);
+        return true;
+    }
+
+    /**
+     * @brief Moves the animated objects to their place in a frame and updates the scene
+     * @param[in] animationIndex Frame index
+     */
+    void SetFrame(int animationIndex)
+    {
+        if (file.animation.tracks.empty())
+        {
+            return;
+        }
+        file.animation.Evaluate((float)animationIndex);
+        file.animation.Apply(scene.objects, changed);
+        scene.Update(changed);
+    }
+};
+
+/**
+ * @brief File name extension of an output format
+ * @param[in] format Output format
+ * @return Extension, including the dot
+ */
+const char *ImageFormatExtension(ImageFormat format)
+{
+    switch (format)
+    {
+    case IMAGE_PPM:
+        return ".ppm";
+    case IMAGE_PFM:
+        return ".pfm";
+    case IMAGE_QOI:
+        return ".qoi";
+    default:
+        return ".png";
+    }
+}
+
+/**
+ * @brief Appends a 32-bit value, most significant byte first
+ */
+void PushBigEndian(std::vector<unsigned char> &out, uint32_t value)
+{
+    out.push_back((unsigned char)(value >> 24));
+    out.push_back((unsigned char)(value >> 16));
+    out.push_back((unsigned char)(value >> 8));
+    out.push_back((unsigned char)value);
+}
+
+/**
+ * @brief Encodes an image as binary PPM (P6)
+ * @param[in]  image    Image to encode
+ * @param[out] out      Encoded file contents
+ */
+void EncodePPM(const Image &image, std::vector<unsigned char> &out)
+{
+    std::string header = "P6\n" + std::to_string(image.width) + " " + std::to_string(image.height) + "\n255\n";
+    out.assign(header.begin(), header.end());
+    out.insert(out.end(), image.data.begin(), image.data.end());
+}
+
+/**
+ * @brief Encodes the linear framebuffer colors as little-endian PFM, without tone mapping. PFM stores rows from the
+ * bottom up.
+ * @param[in]  hdr      Framebuffer to encode
+ * @param[out] out      Encoded file contents
+ */
+void EncodePFM(const FrameBuffer &hdr, std::vector<unsigned char> &out)
+{
+    std::string header = "PF\n" + std::to_string(hdr.width) + " " + std::to_string(hdr.height) + "\n-1.0\n";
+    out.assign(header.begin(), header.end());
+    size_t rowBytes = (size_t)hdr.width * 3 * sizeof(float);
+    size_t offset = out.size();
+    out.resize(offset + rowBytes * hdr.height);
+    for (int y = 0; y < hdr.height; y++)
+    {
+        memcpy(&out[offset + (hdr.height - 1 - y) * rowBytes], &hdr.data[(size_t)y * hdr.width * 3], rowBytes);
+    }
+}
+
+/**
+ * @brief Encodes an image in the QOI format: a single pass that codes every pixel as a run, a reference to a recently
+ * seen color, a small difference to the previous pixel, or the full color
+ * @param[in]  image    Image to encode
+ * @param[out] out      Encoded file contents
+ */
+void EncodeQOI(const Image &image, std::vector<unsigned char> &out)
+{
+    out.clear();
+    out.reserve(14 + image.data.size() / 2);
+    const char magic[] = "qoif";
+    out.insert(out.end(), magic, magic + 4);
+    PushBigEndian(out, image.width);
+    PushBigEndian(out, image.height);
+    out.push_back(3); // RGB
+    out.push_back(0); // sRGB with linear alpha
+
+    unsigned char index[64][4] = {}; // Recently seen colors by hash; the fourth byte is set once an entry is used
+    unsigned char previous[3] = {0, 0, 0};
+    int run = 0;
+    size_t pixelCount = (size_t)image.width * image.height;
+    for (size_t p = 0; p < pixelCount; p++)
+    {
+        const unsigned char *pixel = &image.data[p * 3];
+        if (pixel[0] == previous[0] && pixel[1] == previous[1] && pixel[2] == previous[2])
+        {
+            run++;
+            if (run == 62 || p == pixelCount - 1)
+            {
+                out.push_back((unsigned char)(0xc0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0)
+        {
+            out.push_back((unsigned char)(0xc0 | (run - 1)));
+            run = 0;
+        }
+
+        int hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + 255 * 11) % 64;
+        if (index[hash][3] && index[hash][0] == pixel[0] && index[hash][1] == pixel[1] && index[hash][2] == pixel[2])
+        {
+            out.push_back((unsigned char)hash);
+        }
+        else
+        {
+            memcpy(index[hash], pixel, 3);
+            index[hash][3] = 1;
+            int dr = (signed char)(pixel[0] - previous[0]);
+            int dg = (signed char)(pixel[1] - previous[1]);
+            int db = (signed char)(pixel[2] - previous[2]);
+            int drg = dr - dg;
+            int dbg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            }
+            else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+            {
+                out.push_back((unsigned char)(0x80 | (dg + 32)));
+                out.push_back((unsigned char)((drg + 8) << 4 | (dbg + 8)));
+            }
+            else
+            {
+                out.push_back(0xfe);
+                out.insert(out.end(), pixel, pixel + 3);
+            }
+        }
+        memcpy(previous, pixel, 3);
+    }
+
+    const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    out.insert(out.end(), end, end + 8);
+}
+
+/**
+ * @brief Encodes an image as PNG with the encoder from stb_image_write
+ * @param[in]  image    Image to encode
+ * @param[out] out      Encoded file contents
+ */
+void EncodePNGSingle(const Image &image, std::vector<unsigned char> &out)
+{
+    int size = 0;
+    unsigned char *png = stbi_write_png_to_mem(image.data.data(), image.width * 3, image.width, image.height, 3, &size);
+    out.assign(png, png + size);
+    STBIW_FREE(png);
+}
+
+const int PNG_BAND_ROWS = 32; // Rows per independently compressed band of the multithreaded PNG encoder
+
+/**
+ * @brief CRC-32 as used by PNG chunks
+ * @param[in] crc   CRC of the preceding bytes (0 to start)
+ * @param[in] data  Bytes to add
+ * @param[in] size  Number of bytes
+ * @return Updated CRC
+ */
+uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t size)
+{
+    static const std::vector<uint32_t> table = []
+    {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+const uint32_t ADLER_BASE = 65521; // Largest prime below 2^16
+
+/**
+ * @brief Adler-32 checksum of a zlib stream
+ * @param[in] data  Bytes to checksum
+ * @param[in] size  Number of bytes
+ * @return Checksum
+ */
+uint32_t Adler32(const unsigned char *data, size_t size)
+{
+    uint32_t s1 = 1;
+    uint32_t s2 = 0;
+    while (size > 0)
+    {
+        size_t block = std::min(size, (size_t)5552); // Longest run that cannot overflow s2
+        for (size_t i = 0; i < block; i++)
+        {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+        data += block;
+        size -= block;
+    }
+    return s2 << 16 | s1;
+}
+
+/**
+ * @brief Adler-32 of two byte ranges joined together, from the checksums of the ranges
+ * @param[in] first         Checksum of the first range
+ * @param[in] second        Checksum of the second range
+ * @param[in] secondSize    Length of the second range
+ * @return Checksum of both ranges
+ */
+uint32_t Adler32Combine(uint32_t first, uint32_t second, size_t secondSize)
+{
+    uint32_t rem = (uint32_t)(secondSize % ADLER_BASE);
+    uint32_t s1 = first & 0xffff;
+    uint32_t s2 = (uint32_t)(((uint64_t)rem * s1) % ADLER_BASE);
+    s1 += (second & 0xffff) + ADLER_BASE - 1;
+    s2 += (first >> 16) + (second >> 16) + ADLER_BASE - rem;
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+    return s2 << 16 | s1;
+}
+
+// Deflate output, written least significant bit first
+struct DeflateBits
+{
+    std::vector<unsigned char> &out; // Compressed bytes
+    uint32_t buffer = 0;             // Bits that do not fill a byte yet
+    int count = 0;                   // Number of bits in buffer
+
+    DeflateBits(std::vector<unsigned char> &o) : out(o) {}
+
+    void Add(uint32_t bits, int length)
+    {
+        buffer |= bits << count;
+        count += length;
+        while (count >= 8)
+        {
+            out.push_back((unsigned char)buffer);
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    // Huffman codes are stored starting with their most significant bit
+    void AddCode(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++)
+        {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        Add(reversed, length);
+    }
+
+    // Literal/length symbol with the fixed Huffman code
+    void AddSymbol(int symbol)
+    {
+        if (symbol <= 143)
+        {
+            AddCode(0x30 + symbol, 8);
+        }
+        else if (symbol <= 255)
+        {
+            AddCode(0x190 + symbol - 144, 9);
+        }
+        else if (symbol <= 279)
+        {
+            AddCode(symbol - 256, 7);
+        }
+        else
+        {
+            AddCode(0xc0 + symbol - 280, 8);
+        }
+    }
+
+    void Align()
+    {
+        if (count > 0)
+        {
+            Add(0, 8 - count);
+        }
+    }
+};
+
+/**
+ * @brief Compresses data as one fixed-Huffman deflate block that only refers back into the same data. Unless the
+ * block is the last one of the stream, it is followed by an empty stored block, which ends it on a byte boundary
+ * so that blocks compressed separately can simply be concatenated.
+ * @param[in]  data     Bytes to compress
+ * @param[in]  size     Number of bytes
+ * @param[in]  level    Earlier positions compared at each byte, like the stb_image_write quality (at least 1)
+ * @param[in]  final    True for the last block of the stream
+ * @param[out] out      Compressed bytes are appended here
+ */
+void DeflateBlock(const unsigned char *data, int size, int level, bool final, std::vector<unsigned char> &out)
+{
+    static const unsigned short lengthBase[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 259};
+    static const unsigned char lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const unsigned short distanceBase[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32769};
+    static const unsigned char distanceExtra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    const int window = 32768;
+    const int hashBits = 15;
+
+    std::vector<int> head(1 << hashBits, -1); // Latest position of each 3-byte hash
+    std::vector<int> previous(size);          // Earlier position with the same hash as each position
+    auto hash = [&](int i)
+    {
+        uint32_t key = data[i] | data[i + 1] << 8 | data[i + 2] << 16;
+        return (key * 2654435761u) >> (32 - hashBits);
+    };
+    auto findMatch = [&](int i, int &distance)
+    {
+        int best = 0;
+        int limit = std::min(258, size - i);
+        int chain = level;
+        for (int j = head[hash(i)]; j >= 0 && i - j <= window && chain > 0; j = previous[j], chain--)
+        {
+            int length = 0;
+            while (length < limit && data[j + length] == data[i + length])
+            {
+                length++;
+            }
+            if (length > best)
+            {
+                best = length;
+                distance = i - j;
+                if (length == limit)
+                {
+                    break;
+                }
+            }
+        }
+        return best;
+    };
+
+    DeflateBits bits(out);
+    bits.Add(final ? 1 : 0, 1); // BFINAL
+    bits.Add(1, 2);             // BTYPE = fixed Huffman
+
+    int i = 0;
+    while (i + 3 <= size)
+    {
+        int distance = 0;
+        int length = findMatch(i, distance);
+        uint32_t h = hash(i);
+        previous[i] = head[h];
+        head[h] = i;
+
+        // Lazy matching: emit a literal instead if the match starting at the next byte is longer
+        if (length >= 3 && i + 4 <= size)
+        {
+            int nextDistance = 0;
+            if (findMatch(i + 1, nextDistance) > length)
+            {
+                length = 0;
+            }
+        }
+
+        if (length >= 3)
+        {
+            int code = 0;
+            while (length > lengthBase[code + 1] - 1)
+            {
+                code++;
+            }
+            bits.AddSymbol(257 + code);
+            bits.Add(length - lengthBase[code], lengthExtra[code]);
+            code = 0;
+            while (distance > distanceBase[code + 1] - 1)
+            {
+                code++;
+            }
+            bits.AddCode(code, 5);
+            bits.Add(distance - distanceBase[code], distanceExtra[code]);
+            i += length;
+        }
+        else
+        {
+            bits.AddSymbol(data[i]);
+            i++;
+        }
+    }
+    for (; i < size; i++)
+    {
+        bits.AddSymbol(data[i]);
+    }
+    bits.AddSymbol(256); // End of block
+
+    if (!final)
+    {
+        bits.Add(0, 3); // Empty stored block: header, then LEN = 0 and NLEN = 0xffff on the next byte boundary
+        bits.Align();
+        bits.Add(0, 16);
+        bits.Add(0xffff, 16);
+    }
+    bits.Align();
+}
+
+/**
+ * @brief Paeth predictor of PNG filter type 4
+ */
+inline unsigned char PaethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+    {
+        return (unsigned char)a;
+    }
+    return (unsigned char)(pb <= pc ? b : c);
+}
+
+/**
+ * @brief Applies a PNG filter to one row of RGB pixels
+ * @param[in]  row      Row to filter
+ * @param[in]  above    Row above it (all zeros for the first row)
+ * @param[in]  length   Row length in bytes
+ * @param[in]  type     Filter type (0 to 4)
+ * @param[out] out      Filtered bytes, without the filter type byte
+ */
+void FilterPNGRow(const unsigned char *row, const unsigned char *above, int length, int type, unsigned char *out)
+{
+    for (int i = 0; i < length; i++)
+    {
+        int left = i >= 3 ? row[i - 3] : 0;
+        int upLeft = i >= 3 ? above[i - 3] : 0;
+        int predicted = 0;
+        switch (type)
+        {
+        case 1:
+            predicted = left;
+            break;
+        case 2:
+            predicted = above[i];
+            break;
+        case 3:
+            predicted = (left + above[i]) >> 1;
+            break;
+        case 4:
+            predicted = PaethPredictor(left, above[i], upLeft);
+            break;
+        }
+        out[i] = (unsigned char)(row[i] - predicted);
+    }
+}
+
+/**
+ * @brief Appends a PNG chunk
+ * @param[out] out  PNG file contents
+ * @param[in]  type Chunk type (four characters)
+ * @param[in]  data Chunk data
+ * @param[in]  size Data size in bytes
+ */
+void PushPNGChunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, size_t size)
+{
+    PushBigEndian(out, (uint32_t)size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    PushBigEndian(out, Crc32(0, &out[start], out.size() - start));
+}
+
+/**
+ * @brief Encodes an image as PNG on every thread of the scheduler. The image is split into bands of PNG_BAND_ROWS
+ * rows that are filtered and deflated independently and then joined into one zlib stream, so the output only
+ * depends on the settings and not on the number of threads.
+ * @param[in]  image        Image to encode
+ * @param[in]  level        Compression level (see DeflateBlock)
+ * @param[in]  filter       PNG filter type (0 to 4) for every row, or -1 to pick the best one per row
+ * @param[in]  scheduler    Threads to encode with
+ * @param[out] out          Encoded file contents
+ */
+void EncodePNGParallel(const Image &image, int level, int filter, TileScheduler &scheduler, std::vector<unsigned char> &out)
+{
+    int rowSize = image.width * 3;
+    int bandCount = (image.height + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+    std::vector<std::vector<unsigned char>> compressed(bandCount);
+    std::vector<uint32_t> checksums(bandCount);
+    std::vector<size_t> filteredSizes(bandCount);
+
+    scheduler.Run(bandCount, [&](int band, int)
+    {
+        int y0 = band * PNG_BAND_ROWS;
+        int y1 = std::min(image.height, y0 + PNG_BAND_ROWS);
+        std::vector<unsigned char> filtered((size_t)(y1 - y0) * (rowSize + 1));
+        std::vector<unsigned char> candidate(rowSize);
+        std::vector<unsigned char> zeros(rowSize, 0);
+        for (int y = y0; y < y1; y++)
+        {
+            const unsigned char *row = &image.data[(size_t)y * rowSize];
+            const unsigned char *above = y > 0 ? row - rowSize : zeros.data();
+            unsigned char *dest = &filtered[(size_t)(y - y0) * (rowSize + 1)];
+            int type = filter;
+            if (type < 0)
+            {
+                // Pick the filter with the smallest sum of absolute (signed) filtered bytes, as stb_image_write does
+                long long bestCost = std::numeric_limits<long long>::max();
+                for (int t = 0; t < 5; t++)
+                {
+                    FilterPNGRow(row, above, rowSize, t, candidate.data());
+                    long long cost = 0;
+                    for (int i = 0; i < rowSize; i++)
+                    {
+                        cost += std::abs((signed char)candidate[i]);
+                    }
+                    if (cost < bestCost)
+                    {
+                        bestCost = cost;
+                        type = t;
+                    }
+                }
+            }
+            dest[0] = (unsigned char)type;
+            FilterPNGRow(row, above, rowSize, type, dest + 1);
+        }
+        DeflateBlock(filtered.data(), (int)filtered.size(), std::max(1, level), band == bandCount - 1, compressed[band]);
+        checksums[band] = Adler32(filtered.data(), filtered.size());
+        filteredSizes[band] = filtered.size();
+    });
+
+    std::vector<unsigned char> stream;
+    stream.push_back(0x78); // Deflate, 32K window
+    stream.push_back(0x5e);
+    uint32_t adler = 1;
+    for (int band = 0; band < bandCount; band++)
+    {
+        stream.insert(stream.end(), compressed[band].begin(), compressed[band].end());
+        adler = Adler32Combine(adler, checksums[band], filteredSizes[band]);
+    }
+    PushBigEndian(stream, adler);
+
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.assign(signature, signature + 8);
+    std::vector<unsigned char> header;
+    PushBigEndian(header, image.width);
+    PushBigEndian(header, image.height);
+    header.push_back(8); // Bit depth
+    header.push_back(2); // RGB
+    header.push_back(0); // Compression, filter and interlace methods
+    header.push_back(0);
+    header.push_back(0);
+    PushPNGChunk(out, "IHDR", header.data(), header.size());
+    PushPNGChunk(out, "IDAT", stream.data(), stream.size());
+    PushPNGChunk(out, "IEND", nullptr, 0);
+}
+
+/**
+ * @brief Encodes a frame in the output format selected by the options. PFM files get the linear framebuffer colors,
+ * the other formats the tone-mapped image.
+ * @param[in]  frame        Frame to encode
+ * @param[in]  options      Output format and PNG settings
+ * @param[in]  scheduler    Threads for the multithreaded PNG encoder
+ * @param[out] out          Encoded file contents
+ */
+void EncodeImage(const Frame &frame, const RenderOptions &options, TileScheduler &scheduler, std::vector<unsigned char> &out)
+{
+    const Image &image = frame.image;
+    switch (options.imageFormat)
+    {
+    case IMAGE_PPM:
+        EncodePPM(image, out);
+        break;
+    case IMAGE_PFM:
+        EncodePFM(frame.hdr, out);
+        break;
+    case IMAGE_QOI:
+        EncodeQOI(image, out);
+        break;
+    default:
+        if (options.pngThreads > 1)
+        {
+            EncodePNGParallel(image, options.pngLevel, options.pngFilter, scheduler, out);
+        }
+        else
+        {
+            EncodePNGSingle(image, out);
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Writes a whole file
+ * @param[in] path  File to write
+ * @param[in] data  File contents
+ * @return False if the file could not be written
+ */
+bool WriteFile(const std::string &path, const std::vector<unsigned char> &data)
+{
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char *)data.data(), data.size());
+    return (bool)file;
+}
+
+const int FRAME_WRITE_QUEUE = 4; // Finished frames that may wait for the writer before rendering blocks
+
+/**
+ * Encodes and writes finished frames on a background thread, so that rendering continues with the next frame instead
+ * of waiting for the encoder. Submit() blocks once FRAME_WRITE_QUEUE frames are waiting. Written
+ * frames are kept and handed out again by TakeFrame(), so a long sequence only allocates a few frame buffers.
+ */
+struct FrameWriter
+{
+    double writeSeconds = 0.0;            // Time the writer thread spent encoding and writing
+    std::vector<std::string> failedFiles; // Files that could not be written
+
+    /**
+     * @brief Constructor. Starts the writer thread.
+     * @param[in] renderOptions Output format and PNG settings
+     */
+    FrameWriter(const RenderOptions &renderOptions)
+        : options(renderOptions), encoder(renderOptions.pngThreads), thread(&FrameWriter::WriterLoop, this)
+    {
+    }
+
+    FrameWriter(const FrameWriter &) = delete;
+    FrameWriter &operator=(const FrameWriter &) = delete;
+
+    ~FrameWriter()
+    {
+        Finish();
+    }
+
+    /**
+     * @brief Gets a frame to render into, reusing one that has already been written if possible
+     * @param[in] width     Frame width
+     * @param[in] height    Frame height
+     * @return Frame of the requested size. Its previous contents are not cleared.
+     */
+    Frame TakeFrame(int width, int height)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < freeFrames.size(); i++)
+        {
+            if (freeFrames[i].image.width == width && freeFrames[i].image.height == height)
+            {
+                Frame frame = std::move(freeFrames[i]);
+                freeFrames.erase(freeFrames.begin() + i);
+                return frame;
+            }
+        }
+        return Frame(width, height);
+    }
+
+    /**
+     * @brief Queues a finished frame for writing. Blocks while the queue is full.
+     * @param[in] fileName  File to write
+     * @param[in] frame     Frame to write; the writer takes ownership of it
+     */
+    void Submit(const std::string &fileName, Frame &&frame)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            spaceCondition.wait(lock, [this]
+            {
+                return (int)pending.size() < FRAME_WRITE_QUEUE;
+            });
+            pending.push_back(PendingFrame{fileName, std::move(frame)});
+        }
+        workCondition.notify_one();
+    }
+
+    /**
+     * @brief Writes every queued frame and stops the writer thread
+     */
+    void Finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping)
+            {
+                return;
+            }
+            stopping = true;
+        }
+        workCondition.notify_one();
+        thread.join();
+    }
+
+private:
+    struct PendingFrame
+    {
+        std::string fileName; // File to write
+        Frame frame;          // Frame to write
+    };
+
+    const RenderOptions &options;           // Output format and PNG settings
+    TileScheduler encoder;                  // Threads of the multithreaded PNG encoder, driven by the writer thread
+    std::mutex mutex;                       // Guards everything below
+    std::condition_variable workCondition;  // Signalled when a frame is queued or the writer should stop
+    std::condition_variable spaceCondition; // Signalled when the writer takes a frame off the queue
+    std::vector<PendingFrame> pending;      // Frames waiting to be written, oldest first
+    std::vector<Frame> freeFrames;          // Written frames, ready to be rendered into again
+    bool stopping = false;                  // Set by Finish()
+    std::thread thread;                     // Writer thread (declared last so that it starts after the members above)
+
+    void WriterLoop()
+    {
+        std::vector<unsigned char> encoded;
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            workCondition.wait(lock, [this]
+            {
+                return stopping || !pending.empty();
+            });
+            if (pending.empty())
+            {
+                return;
+            }
+            PendingFrame next = std::move(pending.front());
+            pending.erase(pending.begin());
+            lock.unlock();
+            spaceCondition.notify_one();
+
+            auto writeStart = std::chrono::steady_clock::now();
+            EncodeImage(next.frame, options, encoder, encoded);
+            bool written = WriteFile(next.fileName, encoded);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - writeStart).count();
+
+            lock.lock();
+            writeSeconds += seconds;
+            if (!written)
+            {
+                failedFiles.push_back(next.fileName);
+            }
+            freeFrames.push_back(std::move(next.frame));
+        }
+    }
+};
+
+#ifdef COUNT_ALLOCATIONS
+// Global allocation counter for the benchmarks. Only compiled in with -DCOUNT_ALLOCATIONS.
+std::atomic<long long> allocationCount(0);
+
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+#endif
+
+/**
+ * @brief Number of heap allocations made so far, or -1 if allocation counting is not compiled in
+ */
+long long GetAllocationCount()
+{
+#ifdef COUNT_ALLOCATIONS
+    return allocationCount.load();
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief Fills a scene with randomly placed spheres and triangles (half of each) and two lights, for benchmarking
+ * @param[out] scene        Scene to fill
+ * @param[out] camera       Camera looking at the generated objects
+ * @param[in]  objectCount  Number of objects to generate
+ * @param[in]  seed         Random seed
+ * @param[in]  simdLevel    Widest primitive kernels to use
+ */
+void BuildRandomScene(Scene &scene, Camera &camera, int objectCount, unsigned int seed, SimdLevel simdLevel)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (int i = 0; i < objectCount; i++)
+    {
+        glm::vec3 center(position(rng), position(rng), position(rng));
+        SceneObject *obj;
+        if (i % 2 == 0)
+        {
+            Sphere *sphere = scene.arena.New<Sphere>();
+            sphere->center = center;
+            sphere->radius = 0.1f + 0.2f * unit(rng);
+            obj = sphere;
+        }
+        else
+        {
+            Triangle *triangle = scene.arena.New<Triangle>();
+            triangle->A = center + glm::vec3(offset(rng), offset(rng), offset(rng));
+            triangle->B = center + glm::vec3(offset(rng), offset(rng), offset(rng));
+            triangle->C = center + glm::vec3(offset(rng), offset(rng), offset(rng));
+            obj = triangle;
+        }
+        // Colors are rounded to 1/32 steps so that any object count fits in the material table
+        Material material;
+        material.ambient = glm::vec3(0.1f);
+        material.diffuse = glm::floor(glm::vec3(unit(rng), unit(rng), unit(rng)) * 32.0f) / 32.0f;
+        material.specular = glm::vec3(0.5f);
+        material.shininess = 32.0f;
+        scene.materials.Add(material, obj->materialId);
+        scene.objects.push_back(obj);
+    }
+
+    Light light;
+    light.position = glm::vec4(0.0f, 20.0f, 20.0f, 1.0f);
+    light.ambient = glm::vec3(0.2f);
+    light.diffuse = glm::vec3(1.0f);
+    light.specular = glm::vec3(1.0f);
+    light.constant = 1.0f;
+    light.linear = 0.0f;
+    light.quadratic = 0.0f;
+    scene.lights.push_back(light);
+    light.position = glm::vec4(-1.0f, -1.0f, -1.0f, 0.0f);
+    scene.lights.push_back(light);
+
+    scene.Build(simdLevel);
+
+    camera.position = glm::vec3(0.0f, 0.0f, 30.0f);
+    camera.lookTarget = glm::vec3(0.0f);
+    camera.globalUp = glm::vec3(0.0f, 1.0f, 0.0f);
+    camera.fovY = 45.0f;
+    camera.focalLength = 1.0f;
+    camera.imageWidth = 640;
+    camera.imageHeight = 480;
+}
+
+/**
+ * @brief Traces every primary ray of a generated scene on one thread, and reports rays per second and heap allocations per ray
+ * @param[in] options Command-line options
+ */
+void BenchmarkRaycast(const RenderOptions &options)
+{
+    Scene scene;
+    Camera camera;
+    BuildRandomScene(scene, camera, options.benchmarkObjects, 1, options.simdLevel);
+
+    int rayCount = camera.imageWidth * camera.imageHeight;
+    glm::vec3 checksum(0.0f);
+    long long allocationsBefore = GetAllocationCount();
+    auto start = std::chrono::steady_clock::now();
+    for (int y = 0; y < camera.imageHeight; y++)
+    {
+        for (int x = 0; x < camera.imageWidth; x++)
+        {
+            Ray ray = GetRayThruPixel(camera, x, y);
+            checksum += RayTrace(ray, scene, camera, 1);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    long long allocations = GetAllocationCount() - allocationsBefore;
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "Objects:           " << scene.objects.size() << std::endl;
+    std::cout << "Kernels:           " << SimdKernels::Name(scene.kernels.level) << std::endl;
+    std::cout << "Primary rays:      " << rayCount << std::endl;
+    std::cout << "Time:              " << seconds << " s" << std::endl;
+    std::cout << "Primary rays/s:    " << rayCount / seconds << std::endl;
+    if (allocationsBefore < 0)
+    {
+        std::cout << "Allocations/ray:   n/a (build with -DCOUNT_ALLOCATIONS)" << std::endl;
+    }
+    else
+    {
+        std::cout << "Allocations/ray:   " << (double)allocations / rayCount << std::endl;
+    }
+    std::cout << "Checksum:          " << checksum.r + checksum.g + checksum.b << std::endl;
+}
+
+/**
+ * @brief Measures ray-triangle tests per second of the original Triangle::Intersect() against the precomputed kernel
+ */
+void BenchmarkTriangle(const RenderOptions &)
+{
+    const int triangleCount = 1024;
+    const int rayCount = 4096;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+
+    std::vector<Triangle> triangles(triangleCount);
+    std::vector<TriangleData> triangleData(triangleCount);
+    for (int i = 0; i < triangleCount; i++)
     {
-        upVector = glm::normalize(upVector);
+        glm::vec3 center(position(rng), position(rng), position(rng));
+        triangles[i].A = center + 0.2f * glm::vec3(position(rng), position(rng), position(rng));
+        triangles[i].B = center + 0.2f * glm::vec3(position(rng), position(rng), position(rng));
+        triangles[i].C = center + 0.2f * glm::vec3(position(rng), position(rng), position(rng));
+        triangles[i].Precompute();
+        triangleData[i] = triangles[i].data;
     }
 
-    if (vVector != glm::vec3(0.0f))
+    std::vector<Ray> rays(rayCount);
+    for (int i = 0; i < rayCount; i++)
     {
-        vVector = glm::normalize(vVector);
+        rays[i].origin = 5.0f * glm::normalize(glm::vec3(position(rng), position(rng), position(rng)));
+        rays[i].direction = glm::normalize(glm::vec3(position(rng), position(rng), position(rng)) - rays[i].origin);
     }
 
-    // lower-left corner point L calculations
-    glm::vec3 L = camera.position + (lookDirection * camera.focalLength) - (upVector * (wViewport / 2)) - (vVector * (hViewport / 2));
+    double tests = (double)triangleCount * rayCount;
+    std::cout << "Triangles: " << triangleCount << ", rays: " << rayCount << std::endl;
 
-    // calculate ray going through pixel (x,y)
-    float s = ((pixelX + 0.5) / camera.imageWidth) * wViewport;
-    float t = ((pixelY + 0.5) / camera.imageHeight) * hViewport;
-    glm::vec3 P = L + upVector * s + vVector * t;
-    glm::vec3 rayDirection = P - ray.origin;
+    // Original code path: virtual call that also computes the point and normal
+    {
+        long long hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rayCount; r++)
+        {
+            for (int i = 0; i < triangleCount; i++)
+            {
+                SceneObject *obj = &triangles[i];
+                glm::vec3 point, normal;
+                if (obj->Intersect(rays[r], point, normal) > 0)
+                {
+                    hits++;
+                }
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Intersect():         " << tests / seconds / 1e6 << " M tests/s (" << hits << " hits)" << std::endl;
+    }
 
-    if (rayDirection != glm::vec3(0.0f))
+    // Distance-only virtual call on the precomputed data
     {
-        rayDirection = glm::normalize(rayDirection);
+        long long hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rayCount; r++)
+        {
+            for (int i = 0; i < triangleCount; i++)
+            {
+                SceneObject *obj = &triangles[i];
+                float u, v;
+                int subId;
+                if (obj->IntersectDistance(rays[r], FLT_MAX, u, v, subId) > 0)
+                {
+                    hits++;
+                }
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "IntersectDistance(): " << tests / seconds / 1e6 << " M tests/s (" << hits << " hits)" << std::endl;
     }
 
-    ray.direction = rayDirection;
-    return ray;
+    // Kernel over a contiguous array of precomputed triangles
+    {
+        long long hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rayCount; r++)
+        {
+            for (int i = 0; i < triangleCount; i++)
+            {
+                float u, v;
+                if (IntersectTriangle(triangleData[i], rays[r].origin, rays[r].direction, FLT_MAX, u, v) > 0)
+                {
+                    hits++;
+                }
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "IntersectTriangle(): " << tests / seconds / 1e6 << " M tests/s (" << hits << " hits)" << std::endl;
+    }
 }
 
 /**
- * @brief Cast a ray to the scene.
- * @param[in] ray   Ray to cast to the scene
- * @param[in] scene Scene object
- * @return Returns an IntersectionInfo object that will contain the results of the raycast
+ * @brief Measures primary rays per second of GetRayThruPixel() against CameraRayGenerator, and checks that both
+ * produce the same rays
+ * @param[in] options Command-line options
  */
-IntersectionInfo Raycast(const Ray &ray, const Scene &scene)
+void BenchmarkCamera(const RenderOptions &options)
 {
-    std::vector<IntersectionInfo> infoList;
+    Camera camera;
+    camera.imageWidth = 1920;
+    camera.imageHeight = 1080;
+    camera.position = glm::vec3(1.0f, 2.0f, 10.0f);
+    camera.lookTarget = glm::vec3(0.0f);
+    camera.globalUp = glm::vec3(0.0f, 1.0f, 0.0f);
+    camera.fovY = 60.0f;
+    camera.focalLength = 1.0f;
+
+    const int frames = 4;
+    double rayCount = (double)frames * camera.imageWidth * camera.imageHeight;
+    std::vector<Ray> rays(camera.imageWidth);
+
+    // Per-pixel camera setup
+    glm::vec3 checksum(0.0f);
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        for (int y = 0; y < camera.imageHeight; y++)
+        {
+            for (int x = 0; x < camera.imageWidth; x++)
+            {
+                rays[x] = GetRayThruPixel(camera, x, y);
+            }
+            checksum += rays[y % camera.imageWidth].direction;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "GetRayThruPixel():  " << rayCount / seconds / 1e6 << " M rays/s" << std::endl;
+
+    // Generator set up once per frame, a row at a time
+    SimdKernels kernels = SimdKernels::Get(options.simdLevel);
+    long long mismatches = 0;
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        CameraRayGenerator generator(camera, kernels);
+        for (int y = 0; y < camera.imageHeight; y++)
+        {
+            generator.GetRays(0, y, camera.imageWidth, rays.data());
+            checksum += rays[y % camera.imageWidth].direction;
+        }
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "CameraRayGenerator: " << rayCount / seconds / 1e6 << " M rays/s (" << SimdKernels::Name(kernels.level) << " kernels)" << std::endl;
+
+    CameraRayGenerator generator(camera, kernels);
+    for (int y = 0; y < camera.imageHeight; y++)
+    {
+        generator.GetRays(0, y, camera.imageWidth, rays.data());
+        for (int x = 0; x < camera.imageWidth; x++)
+        {
+            Ray expected = GetRayThruPixel(camera, x, y);
+            if (expected.origin != rays[x].origin || expected.direction != rays[x].direction)
+            {
+                mismatches++;
+            }
+        }
+    }
+    std::cout << "Mismatched rays:    " << mismatches << std::endl;
+    std::cout << "Checksum:           " << checksum.x + checksum.y + checksum.z << std::endl;
+}
 
-    for (int i = 0; i < scene.objects.size(); i++)
+/**
+ * @brief Loads the --scene file a few times and reports the load time and throughput
+ * @param[in] options Command-line options
+ * @return False if the scene could not be loaded
+ */
+bool BenchmarkLoad(const RenderOptions &options)
+{
+    TileScheduler scheduler(options.threadCount);
+    const int runs = 3;
+    double bestSeconds = DBL_MAX;
+    size_t objectCount = 0;
+    for (int run = 0; run < runs; run++)
     {
-        glm::vec3 outIntersectionPoint(0.0f);
-        glm::vec3 outIntersectionNormal(0.0f);
+        Scene scene;
+        SceneFile file;
+        auto start = std::chrono::steady_clock::now();
+        if (!LoadSceneFile(options.scenePath, scheduler, scene, file))
+        {
+            return false;
+        }
+        bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        objectCount = scene.objects.size();
+    }
 
-        IntersectionInfo ret;
-        ret.incomingRay = ray;
+    MappedFile mapped;
+    mapped.Open(options.scenePath);
+    std::cout << "Scene:     " << options.scenePath << " (" << mapped.size / 1e6 << " MB, " << objectCount << " objects)" << std::endl;
+    std::cout << "Threads:   " << scheduler.threadCount << std::endl;
+    std::cout << "Load time: " << bestSeconds * 1000 << " ms (best of " << runs << ")" << std::endl;
+    std::cout << "Speed:     " << mapped.size / 1e6 / bestSeconds << " MB/s" << std::endl;
+    return true;
+}
 
-        float rayDist = scene.objects[i]->Intersect(ray, outIntersectionPoint, outIntersectionNormal);
+/**
+ * @brief Evaluates --bench-objects random keyframe tracks (half linear, half cubic) over a 1000-frame sequence and
+ * reports the evaluation time per frame
+ * @param[in] options Command-line options
+ */
+void BenchmarkAnimation(const RenderOptions &options)
+{
+    const int frames = 1000;
+    const int keysPerTrack = 8;
 
-        // Fields that need to be populated:
-        ret.intersectionPoint = outIntersectionPoint;   // Intersection point
-        ret.intersectionNormal = outIntersectionNormal; // Intersection normal
-        ret.t = rayDist;                                // Distance from ray origin to intersection point
-        ret.obj = nullptr;                              // First object hit by the ray. Set to nullptr if the ray does not hit anything
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
 
-        if (rayDist > 0)
+    Animation animation;
+    animation.frameCount = frames;
+    animation.tracks.resize(options.benchmarkObjects);
+    for (int i = 0; i < options.benchmarkObjects; i++)
+    {
+        AnimationTrack &track = animation.tracks[i];
+        track.objectIndex = i;
+        track.target = TRACK_CENTER;
+        track.interpolation = (i % 2 == 0) ? TRACK_LINEAR : TRACK_CUBIC;
+        for (int k = 0; k < keysPerTrack; k++)
         {
-            ret.obj = scene.objects[i];
-            infoList.push_back(ret);
+            track.keyFrames.push_back((float)(k * frames / (keysPerTrack - 1)));
+            track.keyValues.push_back(glm::vec3(position(rng), position(rng), position(rng)));
         }
     }
 
-    IntersectionInfo ret;
+    glm::vec3 checksum(0.0f);
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        animation.Evaluate((float)frame);
+        checksum += animation.values[frame % animation.values.size()];
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Tracks:     " << animation.tracks.size() << " (" << keysPerTrack << " keys each)" << std::endl;
+    std::cout << "Frames:     " << frames << std::endl;
+    std::cout << "Per frame:  " << seconds / frames * 1000 << " ms" << std::endl;
+    std::cout << "Per track:  " << seconds / frames / animation.tracks.size() * 1e9 << " ns" << std::endl;
+    std::cout << "Checksum:   " << checksum.x + checksum.y + checksum.z << std::endl;
+}
+
+/**
+ * @brief Brute-force closest hit of camera rays against --bench-objects random spheres and triangles, once through a
+ * virtual IntersectDistance() call per object and once through the type-sorted arrays with the scalar and selected
+ * kernels. Every path must find the same closest object for every ray.
+ * @param[in] options Command-line options
+ */
+void BenchmarkDispatch(const RenderOptions &options)
+{
+    Scene scene;
+    Camera camera;
+    BuildRandomScene(scene, camera, options.benchmarkObjects, 1, options.simdLevel);
+    camera.imageWidth = 64;
+    camera.imageHeight = 48;
 
-    if (infoList.size() <= 0)
+    std::vector<Ray> rays;
+    for (int y = 0; y < camera.imageHeight; y++)
     {
-        ret.obj = nullptr;
+        for (int x = 0; x < camera.imageWidth; x++)
+        {
+            rays.push_back(GetRayThruPixel(camera, x, y));
+        }
     }
-    else
+    int objectCount = (int)scene.objects.size();
+    double tests = (double)objectCount * rays.size();
+    std::cout << "Objects: " << objectCount << ", rays: " << rays.size() << std::endl;
+
+    // Polymorphic path: one indirect call per object
+    std::vector<int> virtualHits(rays.size());
     {
-        ret = infoList[0];
-        for (int i = 0; i < infoList.size(); i++)
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < rays.size(); r++)
         {
-            if (ret.t < 0 && infoList[i].t >= 0)
-            {
-                ret = infoList[i];
-            }
-            if (ret.t > infoList[i].t && infoList[i].t >= 0)
+            HitRecord hit;
+            hit.t = FLT_MAX;
+            hit.primId = -1;
+            for (int i = 0; i < objectCount; i++)
             {
-                ret = infoList[i];
+                float u, v;
+                int subId;
+                float t = scene.objects[i]->IntersectDistance(rays[r], hit.t, u, v, subId);
+                if (t > 0 && t < hit.t)
+                {
+                    hit.t = t;
+                    hit.primId = i;
+                }
             }
+            virtualHits[r] = hit.primId;
         }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::left << std::setw(17) << "Virtual:" << tests / seconds / 1e6 << " M tests/s" << std::endl;
     }
 
-    return ret;
+    // Type-sorted arrays: the whole primitive list is one leaf
+    SimdLevel levels[] = {SIMD_SCALAR, scene.kernels.level};
+    for (int l = 0; l < (levels[1] == SIMD_SCALAR ? 1 : 2); l++)
+    {
+        scene.kernels = SimdKernels::Get(levels[l]);
+        int mismatches = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < rays.size(); r++)
+        {
+            HitRecord hit;
+            hit.t = FLT_MAX;
+            hit.primId = -1;
+            IntersectLeaf(rays[r], scene, 0, objectCount, hit);
+            mismatches += hit.primId != virtualHits[r];
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string label = std::string("Sorted, ") + SimdKernels::Name(levels[l]) + ":";
+        std::cout << std::left << std::setw(17) << label << tests / seconds / 1e6 << " M tests/s";
+        std::cout << (mismatches == 0 ? "" : " (" + std::to_string(mismatches) + " different hits)") << std::endl;
+    }
 }
 
 /**
- * @brief Perform a ray-trace to the scene
- * @param[in] ray       Ray to trace
- * @param[in] scene     Scene data
- * @param[in] camera    Camera data
- * @param[in] maxDepth  Maximum depth of the trace
- * @return Resulting color after the ray bounced around the scene
+ * @brief Builds the BVH over triangles whose binned SAH splits peel off one triangle per level, so that the tree would
+ * be deeper than the traversal stack, and casts random rays through it one at a time and as packets. Every ray must
+ * find the same closest triangle as a brute-force test of every triangle.
+ * @return True if every ray found the brute-force hit
  */
-glm::vec3 RayTrace(const Ray &ray, const Scene &scene, const Camera &camera, int maxDepth = 1)
+bool BenchmarkBVHDepth()
 {
-    glm::vec3 color(0.0f);
+    const int triangleCount = 200;
+    const int rayCount = 16384;
 
-    IntersectionInfo didRayHit = Raycast(ray, scene);
-    if (didRayHit.obj == nullptr)
+    // Triangles face the x axis on alternating sides, each 10% farther out and 20% larger than the last, so that the
+    // largest one is always alone in the outermost bin and splitting it off is the cheapest split. Scalar kernels
+    // keep one primitive per SAH batch.
+    Scene scene;
+    float offset = 1.0f;
+    float size = 1.0f;
+    for (int i = 0; i < triangleCount; i++)
     {
-        return glm::vec3(0.0f);
+        Triangle *triangle = scene.arena.New<Triangle>();
+        float x = i % 2 == 0 ? offset : -offset;
+        triangle->A = glm::vec3(x, -size, -size);
+        triangle->B = glm::vec3(x, size, -size);
+        triangle->C = glm::vec3(x, 0.0f, size);
+        Material material;
+        material.diffuse = glm::vec3(1.0f);
+        scene.materials.Add(material, triangle->materialId);
+        scene.objects.push_back(triangle);
+        offset *= 1.1f;
+        size *= 1.2f;
     }
+    scene.Build(SIMD_SCALAR);
 
-    glm::vec3 ambient(0.0f);
-    glm::vec3 diffuse(0.0f);
-    glm::vec3 specular(0.0f);
-    glm::vec3 lightDirection(0.0f);
-    glm::vec3 colorTemp(0.0f);
-    glm::vec3 colorCombinedTemp(0.0f);
-    float lightDistance = 0.0f;
-    float zeroConst = 0.0f;
+    std::vector<int> depths(scene.bvh.nodes.size(), 0);
+    int maxDepth = 0;
+    for (size_t n = 1; n < scene.bvh.nodes.size(); n++)
+    {
+        depths[n] = depths[scene.bvh.parents[n]] + 1;
+        maxDepth = std::max(maxDepth, depths[n]);
+    }
 
-    for (int i = 0; i < scene.lights.size(); i++)
+    // Rays leave the origin along either side of the x axis, and steeper rays only reach the larger triangles
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> slope(-10.0f, 10.0f);
+    std::vector<Ray> rays(rayCount);
+    std::vector<int> bruteHits(rayCount);
+    for (int r = 0; r < rayCount; r++)
     {
-        if (didRayHit.obj == nullptr)
+        rays[r].origin = glm::vec3(0.0f);
+        rays[r].direction = glm::normalize(glm::vec3(r % 2 == 0 ? 1.0f : -1.0f, slope(rng), slope(rng)));
+        float tClosest = FLT_MAX;
+        bruteHits[r] = -1;
+        for (int i = 0; i < triangleCount; i++)
         {
-            color = glm::vec3(0.0f);
-            continue;
+            float u, v;
+            int subId;
+            float t = scene.objects[i]->IntersectDistance(rays[r], tClosest, u, v, subId);
+            if (t > 0 && t < tClosest)
+            {
+                tClosest = t;
+                bruteHits[r] = i;
+            }
         }
+    }
 
-        float lightW = scene.lights[i].position.w;
-        // std::cout << "Light w: " << lightW << std::endl;
+    int singleMismatches = 0;
+    for (int r = 0; r < rayCount; r++)
+    {
+        singleMismatches += ClosestHit(rays[r], scene).primId != bruteHits[r];
+    }
 
-        // Point Light W
-        if (lightW == 1.0f)
+    int packetMismatches = 0;
+    for (int r = 0; r < rayCount; r += PACKET_SIZE)
+    {
+        RayPacket packet;
+        HitRecord hits[PACKET_SIZE];
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            packet.Set(lane, rays[r + lane], FLT_MAX);
+        }
+        RaycastPacket(packet, LaneMask(PACKET_SIZE), scene, hits);
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
         {
-            // ambient lighting
-            ambient = scene.lights[i].ambient * didRayHit.obj->material.ambient;
+            packetMismatches += hits[lane].primId != bruteHits[r + lane];
+        }
+    }
 
-            // diffuse lighting
-            glm::vec3 norm = didRayHit.intersectionNormal;
-            //lightDirection = glm::length(glm::vec3(scene.lights[i].position) - didRayHit.intersectionPoint);
-            lightDistance = glm::length(glm::vec3(scene.lights[i].position) - didRayHit.intersectionPoint);
-            lightDirection = glm::normalize(glm::vec3(scene.lights[i].position) - didRayHit.intersectionPoint);
-            float diff = std::max(glm::dot(norm, lightDirection), zeroConst);
-            diffuse = scene.lights[i].diffuse * (diff * didRayHit.obj->material.diffuse);
+    std::cout << "Triangles: " << triangleCount << ", BVH depth: " << maxDepth << " (stack " << BVH_STACK_SIZE << "), rays: " << rayCount << std::endl;
+    std::cout << "Single rays: " << (singleMismatches == 0 ? std::string("same hits as brute force") : std::to_string(singleMismatches) + " different hits") << std::endl;
+    std::cout << "Packets:     " << (packetMismatches == 0 ? std::string("same hits as brute force") : std::to_string(packetMismatches) + " different hits") << std::endl;
+    return singleMismatches == 0 && packetMismatches == 0;
+}
 
-            // specular lighting
-            glm::vec3 viewDirection = glm::normalize(camera.position - didRayHit.intersectionPoint);
-            lightDirection = glm::normalize(lightDirection);
-            glm::vec3 reflectDirection = glm::reflect(-lightDirection, norm);
-            float spec = pow(std::max(glm::dot(viewDirection, reflectDirection), zeroConst), didRayHit.obj->material.shininess);
-            specular = scene.lights[i].specular * (spec * didRayHit.obj->material.specular);
+/**
+ * @brief Renders the first frame of the scene file and encodes it in every output format, reporting the encode speed
+ * in MB/s of 8-bit RGB input and the size of the result
+ * @param[in] options Command-line options
+ * @return False if the scene could not be loaded
+ */
+bool BenchmarkEncode(const RenderOptions &options)
+{
+    TileScheduler scheduler(options.threadCount);
+    RenderSession session;
+    if (!session.Load(options.scenePath, scheduler, options.simdLevel))
+    {
+        return false;
+    }
+    session.SetFrame(0);
+    const Camera &camera = session.file.camera;
+    int maxDepth = options.maxDepth >= 0 ? options.maxDepth : session.file.maxDepth;
+    Frame frame(camera.imageWidth, camera.imageHeight);
+    RenderImage(frame.hdr, nullptr, session.scene, camera, maxDepth, scheduler, options, false);
+    ToneMap(frame.hdr, frame.image, options.toneMap, session.scene.kernels, scheduler);
+    const Image &image = frame.image;
 
-            // point light attenuation
-            float distance = glm::length(glm::vec3(scene.lights[i].position) - didRayHit.intersectionPoint);
-            float attenuation = 1.0f / (scene.lights[i].constant + scene.lights[i].linear * distance + scene.lights[i].quadratic * pow(distance, 2));
+    stbi_write_png_compression_level = options.pngLevel;
+    stbi_write_force_png_filter = options.pngFilter;
+    TileScheduler singleThread(1);
+    std::vector<unsigned char> out;
+    double megabytes = image.data.size() / 1e6;
+    std::cout << "Image: " << image.width << "x" << image.height << " (" << megabytes << " MB), PNG level " << options.pngLevel << ", filter " << (options.pngFilter < 0 ? std::string("auto") : std::to_string(options.pngFilter)) << std::endl;
 
-            ambient *= attenuation;
-            diffuse *= attenuation;
-            specular *= attenuation;
-        }
-        else if (lightW == 0.0f)
+    auto measure = [&](const std::string &label, const std::function<void()> &encode)
+    {
+        int runs = 0;
+        double seconds = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        do
+        {
+            encode();
+            runs++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (seconds < 1.0);
+        std::cout << std::left << std::setw(26) << label << megabytes * runs / seconds << " MB/s, " << out.size() / 1024 << " KB" << std::endl;
+    };
+    measure("PPM:", [&]
+    {
+        EncodePPM(image, out);
+    });
+    measure("PFM:", [&]
+    {
+        EncodePFM(frame.hdr, out);
+    });
+    measure("QOI:", [&]
+    {
+        EncodeQOI(image, out);
+    });
+    measure("PNG (stb):", [&]
+    {
+        EncodePNGSingle(image, out);
+    });
+    measure("PNG (bands, 1 thread):", [&]
+    {
+        EncodePNGParallel(image, options.pngLevel, options.pngFilter, singleThread, out);
+    });
+    if (scheduler.threadCount > 1)
+    {
+        measure("PNG (bands, " + std::to_string(scheduler.threadCount) + " threads):", [&]
         {
-            // Directional Light
-            // ambient lighting
-            ambient = scene.lights[i].ambient * didRayHit.obj->material.ambient;
+            EncodePNGParallel(image, options.pngLevel, options.pngFilter, scheduler, out);
+        });
+    }
+    return true;
+}
 
-            // diffuse lighting
-            glm::vec3 norm = didRayHit.intersectionNormal;
-            lightDirection = glm::normalize(-1.0f * glm::vec3(scene.lights[i].position));
-            float diff = std::max(glm::dot(norm, lightDirection), zeroConst);
-            diffuse = diff * (didRayHit.obj->material.diffuse * scene.lights[i].diffuse);
+/**
+ * @brief Converts a framebuffer of random HDR colors to 8 bits with the scalar and SIMD tone map kernels, with the
+ * tone map options from the command line. Every kernel must produce the same bytes as the scalar one.
+ * @param[in] options Command-line options
+ */
+void BenchmarkToneMap(const RenderOptions &options)
+{
+    const int width = 1920;
+    const int height = 1080;
+    const int runs = 20;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> intensity(-0.25f, 4.0f);
+    FrameBuffer hdr(width, height);
+    for (size_t i = 0; i < hdr.data.size(); i++)
+    {
+        hdr.data[i] = intensity(rng);
+    }
 
-            // specular lighting
-            glm::vec3 viewDirection = glm::normalize(camera.position - didRayHit.intersectionPoint);
-            glm::vec3 reflectDirection = glm::reflect(-lightDirection, norm);
-            float spec = pow(std::max(glm::dot(viewDirection, reflectDirection), zeroConst), didRayHit.obj->material.shininess);
-            specular = scene.lights[i].specular * (spec * didRayHit.obj->material.specular);
+    Image reference(width, height);
+    SimdLevel levels[] = {SIMD_SCALAR, SIMD_SSE, SIMD_AVX2};
+    const char *curveNames[] = {"clamp", "reinhard", "aces"};
+    std::cout << "Pixels: " << width << "x" << height << ", exposure x" << options.toneMap.scale << ", curve " << curveNames[options.toneMap.curve] << ", sRGB " << (options.toneMap.srgb ? "on" : "off") << std::endl;
+    for (int l = 0; l < 3 && levels[l] <= options.simdLevel; l++)
+    {
+        SimdKernels kernels = SimdKernels::Get(levels[l]);
+        Image image(width, height);
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < runs; r++)
+        {
+            kernels.toneMap(hdr.data.data(), image.data.data(), (int)hdr.data.size(), options.toneMap);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (l == 0)
+        {
+            reference = image;
         }
+        std::string label = std::string(SimdKernels::Name(levels[l])) + ":";
+        std::cout << std::left << std::setw(8) << label << (double)width * height * runs / seconds / 1e6 << " Mpixels/s";
+        std::cout << (image.data == reference.data ? "" : " (output differs from scalar)") << std::endl;
+    }
+}
 
-        Ray shadow;
-        bool isShadow = false;
-        float shadowVal = 0.0f;
+/**
+ * @brief Runs the benchmark selected with --bench
+ * @param[in] options Command-line options
+ * @return Process exit code
+ */
+int RunBenchmark(const RenderOptions &options)
+{
+    if (options.benchmark == "raycast")
+    {
+        BenchmarkRaycast(options);
+        return 0;
+    }
+    if (options.benchmark == "triangle")
+    {
+        BenchmarkTriangle(options);
+        return 0;
+    }
+    if (options.benchmark == "camera")
+    {
+        BenchmarkCamera(options);
+        return 0;
+    }
+    if (options.benchmark == "load")
+    {
+        return BenchmarkLoad(options) ? 0 : 1;
+    }
+    if (options.benchmark == "animation")
+    {
+        BenchmarkAnimation(options);
+        return 0;
+    }
+    if (options.benchmark == "dispatch")
+    {
+        BenchmarkDispatch(options);
+        return 0;
+    }
+    if (options.benchmark == "bvh-depth")
+    {
+        return BenchmarkBVHDepth() ? 0 : 1;
+    }
+    if (options.benchmark == "encode")
+    {
+        return BenchmarkEncode(options) ? 0 : 1;
+    }
+    if (options.benchmark == "tonemap")
+    {
+        BenchmarkToneMap(options);
+        return 0;
+    }
+
+    std::cout << "Unknown benchmark: " << options.benchmark << std::endl;
+    return 1;
+}
+
+/**
+ * Main function
+ */
+int main(int argc, char *argv[])
+{
+    RenderOptions options = ParseOptions(argc, argv);
+    if (!options.benchmark.empty())
+    {
+        return RunBenchmark(options);
+    }
+
+    std::unique_ptr<TileScheduler> loadScheduler(new TileScheduler(options.threadCount));
+    std::cout << "Rendering with " << loadScheduler->threadCount << " thread(s), " << SimdKernels::Name(options.simdLevel) << " kernels" << std::endl;
+
+    std::vector<std::unique_ptr<RenderSession>> sessions;
+    sessions.emplace_back(new RenderSession());
+    auto loadStart = std::chrono::steady_clock::now();
+    if (!sessions[0]->Load(options.scenePath, *loadScheduler, options.simdLevel))
+    {
+        return 1;
+    }
+    double loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count();
+    const Scene &loadedScene = sessions[0]->scene;
+    std::cout << "Loaded " << options.scenePath << ": " << loadedScene.objects.size() << " objects, " << loadedScene.materials.Size() << " materials, " << loadedScene.lights.size() << " lights in " << loadSeconds * 1000 << " ms" << std::endl;
+
+    // Every frame in flight animates its own copy of the scene, so frames do not have to wait for each other
+    const SceneFile &file = sessions[0]->file;
+    int maxDepth = options.maxDepth >= 0 ? options.maxDepth : file.maxDepth;
+    int frameCount = options.frameCount > 0 ? options.frameCount : file.animation.frameCount;
+    int framesInFlight = std::max(1, std::min(options.framesInFlight, frameCount));
+    for (int slot = 1; slot < framesInFlight; slot++)
+    {
+        sessions.emplace_back(new RenderSession());
+        if (!sessions[slot]->Load(options.scenePath, *loadScheduler, options.simdLevel))
+        {
+            return 1;
+        }
+    }
 
-        for (int j = 0; j < scene.objects.size(); j++)
+    // Split the threads between the frames in flight. The thread that renders a frame is thread 0 of its scheduler.
+    std::vector<std::unique_ptr<TileScheduler>> schedulers;
+    if (framesInFlight == 1)
+    {
+        schedulers.push_back(std::move(loadScheduler));
+    }
+    else
+    {
+        int threadCount = loadScheduler->threadCount;
+        loadScheduler.reset();
+        for (int slot = 0; slot < framesInFlight; slot++)
         {
-            shadow.origin = didRayHit.intersectionPoint + (didRayHit.intersectionNormal * 0.01f);
-            float lightW = scene.lights[i].position.w;
-            glm::vec3 outIntersectionPoint(0.0f);
-            glm::vec3 outIntersectionNormal(0.0f);
-            float rayDist = scene.objects[j]->Intersect(shadow, outIntersectionPoint, outIntersectionNormal);
+            int share = threadCount * (slot + 1) / framesInFlight - threadCount * slot / framesInFlight;
+            schedulers.emplace_back(new TileScheduler(std::max(1, share)));
+        }
+        std::cout << "Rendering " << framesInFlight << " frames at a time" << std::endl;
+    }
 
+    stbi_write_png_compression_level = options.pngLevel;
+    stbi_write_force_png_filter = options.pngFilter;
+    FrameWriter writer(options);
+    std::mutex logMutex;
+    double renderSeconds = 0.0;
+    auto renderStart = std::chrono::steady_clock::now();
+    auto renderFrames = [&](int slot)
+    {
+        RenderSession &session = *sessions[slot];
+        const Camera &camera = session.file.camera;
+        std::unique_ptr<SurfaceBuffer> surfaces;
+        if (options.aaSamples > 0)
+        {
+            surfaces.reset(new SurfaceBuffer(camera.imageWidth, camera.imageHeight));
+        }
+        for (int animationIndex = slot; animationIndex < frameCount; animationIndex += framesInFlight)
+        {
+            auto setupStart = std::chrono::steady_clock::now();
+            session.SetFrame(animationIndex);
+            double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count();
 
-            if (lightW == 0.0f)
+            std::string baseName = "frame" + std::to_string(animationIndex); // You might need to make this a full path if you are on Mac
+            std::string extension = ImageFormatExtension(options.imageFormat);
+            auto traceStart = std::chrono::steady_clock::now();
+            Frame frame = writer.TakeFrame(camera.imageWidth, camera.imageHeight);
+            RayCounts rays;
+            AntiAliasStats antiAlias;
+            ProgressiveStats progressive;
+            if (options.progressive)
             {
-                /* code */
-                shadow.direction = glm::normalize(-glm::vec3(scene.lights[i].position));
-
-                if (rayDist > 0)
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+                if (options.timeBudget > 0.0)
                 {
-                    isShadow = true;
+                    deadline = traceStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.timeBudget));
                 }
-                
+                int pass = 0;
+                auto writePass = [&](const FrameBuffer &hdr)
+                {
+                    Frame preview = writer.TakeFrame(camera.imageWidth, camera.imageHeight);
+                    preview.hdr.data = hdr.data;
+                    if (options.imageFormat != IMAGE_PFM)
+                    {
+                        ToneMap(preview.hdr, preview.image, options.toneMap, session.scene.kernels, *schedulers[slot]);
+                    }
+                    writer.Submit(baseName + "_pass" + std::to_string(pass++) + extension, std::move(preview));
+                };
+                progressive = RenderProgressive(frame.hdr, surfaces.get(), session.scene, camera, maxDepth, *schedulers[slot], options, deadline,
+                                                options.writePasses ? writePass : std::function<void(const FrameBuffer &)>(), rays);
+                antiAlias = progressive.antiAlias;
             }
-            else if (lightW == 1.0f)
+            else
             {
-                /* code */
-                shadow.direction = glm::normalize(glm::vec3(scene.lights[i].position) - shadow.origin);
-
-                if (lightDistance > rayDist && rayDist > 0)
+                rays = RenderImage(frame.hdr, surfaces.get(), session.scene, camera, maxDepth, *schedulers[slot], options, framesInFlight == 1);
+                if (options.aaSamples > 0)
                 {
-                    isShadow = true;
+                    antiAlias = AntiAlias(frame.hdr, *surfaces, session.scene, camera, maxDepth, *schedulers[slot], options, std::chrono::steady_clock::time_point::max(), rays);
                 }
             }
+            double traceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - traceStart).count();
 
-            
+            auto toneMapStart = std::chrono::steady_clock::now();
+            if (options.imageFormat != IMAGE_PFM)
+            {
+                ToneMap(frame.hdr, frame.image, options.toneMap, session.scene.kernels, *schedulers[slot]);
+            }
+            double toneMapSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - toneMapStart).count();
 
-            // In your shadow calculation, remember that directional lights do not have a position,
-            // so you cannot really measure the distance between the intersection point and the
-            // directional light. Also, you are getting the length of lightDirection, which if you
-            // notice is already normalized. Hence, it will always have a length of 1.
-            // if (glm::length(lightDirection) > rayDist && rayDist > 0)
-            
-        }
-        if (isShadow)
-        {
-            // std::cout << "shadow" << std::endl;
-            shadowVal = 1.0f;
-        }
-        else
-        {
-            shadowVal = 0.0f;
-            if (maxDepth > 0)
             {
-                Ray reflection;
-                reflection.origin = didRayHit.intersectionPoint + (didRayHit.intersectionNormal * 0.001f);
-                reflection.direction = glm::reflect(didRayHit.incomingRay.direction, didRayHit.intersectionNormal);
-                float kr = didRayHit.obj->material.shininess / 128;
-                colorCombinedTemp += (kr * RayTrace(reflection, scene, camera, maxDepth - 1));
+                std::lock_guard<std::mutex> lock(logMutex);
+                renderSeconds += traceSeconds;
+                std::cout << "Frame " << animationIndex << ": setup " << setupSeconds * 1000 << " ms";
+                const SceneUpdateStats &update = session.scene.updateStats;
+                if (update.rebuilt)
+                {
+                    std::cout << " (BVH refit " << update.refitSeconds * 1000 << " ms reached SAH cost " << update.costRatio << "x, rebuild " << update.rebuildSeconds * 1000 << " ms)";
+                }
+                else if (!session.changed.empty())
+                {
+                    std::cout << " (BVH refit " << update.refitSeconds * 1000 << " ms, SAH cost " << update.costRatio << "x, last rebuild " << update.rebuildSeconds * 1000 << " ms)";
+                }
+                std::cout << ", render " << traceSeconds * 1000 << " ms, tone map " << toneMapSeconds * 1000 << " ms" << std::endl;
+                std::cout << "Rays: " << rays.closest << " closest-hit, " << rays.shadow << " shadow (max depth " << maxDepth << ")" << std::endl;
+                if (options.progressive)
+                {
+                    std::cout << "Progressive: " << progressive.passesDone << " of " << progressive.passCount << " passes";
+                    std::cout << (progressive.passesDone < progressive.passCount ? " (time budget reached)" : "") << std::endl;
+                }
+                if (options.aaSamples > 0 && antiAlias.skipped)
+                {
+                    std::cout << "Anti-aliasing: skipped (time budget reached)" << std::endl;
+                }
+                else if (options.aaSamples > 0)
+                {
+                    double pixelCount = (double)camera.imageWidth * camera.imageHeight;
+                    std::cout << "Anti-aliasing: " << antiAlias.refinedPixels << " pixels refined (" << 100.0 * antiAlias.refinedPixels / pixelCount << "%), ";
+                    std::cout << antiAlias.samples / pixelCount << " samples per pixel, " << antiAlias.seconds * 1000 << " ms";
+                    std::cout << (antiAlias.complete ? "" : " (time budget reached)") << std::endl;
+                }
             }
+
+            writer.Submit(baseName + extension, std::move(frame));
         }
+    };
 
-        colorTemp = ambient + (1.0f - shadowVal) * (diffuse + specular);
-        colorCombinedTemp += colorTemp;
+    std::vector<std::thread> frameThreads;
+    for (int slot = 1; slot < framesInFlight; slot++)
+    {
+        frameThreads.emplace_back(renderFrames, slot);
     }
+    renderFrames(0);
+    for (size_t i = 0; i < frameThreads.size(); i++)
+    {
+        frameThreads[i].join();
+    }
+    writer.Finish();
+    double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+    std::cout << "Rendered " << frameCount << " frame(s) in " << totalSeconds * 1000 << " ms (render " << renderSeconds * 1000 << " ms, writes " << writer.writeSeconds * 1000 << " ms in the background)" << std::endl;
 
-    color = colorCombinedTemp;
-    return color;
-}
-
-/**
- * Main function
- */
-int main()
-{
-    int bounceY[16] = {8, 7, 6, 5, 4, 3, 2, 1, 1, 2, 3, 4, 5, 6, 7, 8};
-    float pyramidSide1BX[16] = {-9, -8.90625, -8.8125, -8.71875, -8.625, -8.53125, -8.4375, -8.34375, -8.25, -8.15625, -8.0625, -7.96875, -7.875, -7.78125, -7.6875, -7.59375};
-    float pyramidSide1BZ[16] = {4.5, 4.40625, 4.3125, 4.21875, 4.125, 4.03125, 3.9375, 3.84375, 3.75, 3.65625, 3.5625, 3.46875, 3.375, 3.28125, 3.1875, 3.09375};
-    float pyramidSide1CX[16] = {-7.5, -7.40625, -7.3125, -7.21875, -7.125, -7.03125, -6.9375, -6.84375, -6.75, -6.65625, -6.5625, -6.46875, -6.375, -6.28125, -6.1875, -6.09375};
-    float pyramidSide1CZ[16] = {3, 3.09375, 3.1875, 3.28125, 3.375, 3.46875, 3.5625, 3.65625, 3.75, 3.84375, 3.9375, 4.03125, 4.125, 4.21875, 4.3125, 4.40625};
-
-    float pyramidSide2BX[16] = {-7.5, -7.40625, -7.3125, -7.21875, -7.125, -7.03125, -6.9375, -6.84375, -6.75, -6.65625, -6.5625, -6.46875, -6.375, -6.28125, -6.1875, -6.09375};
-    float pyramidSide2BZ[16] = {3, 3.09375, 3.1875, 3.28125, 3.375, 3.46875, 3.5625, 3.65625, 3.75, 3.84375, 3.9375, 4.03125, 4.125, 4.21875, 4.3125, 4.40625};
-    float pyramidSide2CX[16] = {-6, -6.09375, -6.1875, -6.28125, -6.375, -6.46875, -6.5625, -6.65625, -6.75, -6.84375, -6.9375, -7.03125, -7.125, -7.21875, -7.3125, -7.40625};
-    float pyramidSide2CZ[16] = {4.5, 4.59375, 4.6875, 4.78125, 4.875, 4.96875, 5.0625, 5.15625, 5.25, 5.34375, 5.4375, 5.53125, 5.625, 5.71875, 5.8125, 5.90625};
-
-    float pyramidSide3BX[16] = {-6, -6.09375, -6.1875, -6.28125, -6.375, -6.46875, -6.5625, -6.65625, -6.75, -6.84375, -6.9375, -7.03125, -7.125, -7.21875, -7.3125, -7.40625};
-    float pyramidSide3BZ[16] = {4.5, 4.59375, 4.6875, 4.78125, 4.875, 4.96875, 5.0625, 5.15625, 5.25, 5.34375, 5.4375, 5.53125, 5.625, 5.71875, 5.8125, 5.90625};
-    float pyramidSide3CX[16] = {-7.5, -7.59375, -7.6875, -7.78125, -7.875, -7.96875, -8.0625, -8.15625, -8.25, -8.34375, -8.4375, -8.53125, -8.625, -8.71875, -8.8125, -8.90625};
-    float pyramidSide3CZ[16] = {6, 5.90625, 5.8125, 5.71875, 5.625, 5.53125, 5.4375, 5.34375, 5.25, 5.15625, 5.0625, 4.96875, 4.875, 4.78125, 4.6875, 4.59375};
-
-    float pyramidSide4BX[16] = {-7.5, -7.59375, -7.6875, -7.78125, -7.875, -7.96875, -8.0625, -8.15625, -8.25, -8.34375, -8.4375, -8.53125, -8.625, -8.71875, -8.8125, -8.90625};
-    ;
-    float pyramidSide4BZ[16] = {6, 5.90625, 5.8125, 5.71875, 5.625, 5.53125, 5.4375, 5.34375, 5.25, 5.15625, 5.0625, 4.96875, 4.875, 4.78125, 4.6875, 4.59375};
-    float pyramidSide4CX[16] = {-9, -8.90625, -8.8125, -8.71875, -8.625, -8.53125, -8.4375, -8.34375, -8.25, -8.15625, -8.0625, -7.96875, -7.875, -7.78125, -7.6875, -7.59375};
-    float pyramidSide4CZ[16] = {4.5, 4.40625, 4.3125, 4.21875, 4.125, 4.03125, 3.9375, 3.84375, 3.75, 3.65625, 3.5625, 3.46875, 3.375, 3.28125, 3.1875, 3.09375};
-    for (int animationIndex = 0; animationIndex < 16; animationIndex++)
+    for (size_t i = 0; i < writer.failedFiles.size(); i++)
     {
-        Scene scene;
-        Camera camera;
-        Sphere *sphere;
-        Triangle *triangle;
-
-        std::string filepath;
-        std::fstream scenefile;
-        std::vector<std::string> filecontent;
-        // std::cout << "Enter Scene (e.g. scene2d.test)" << std::endl;
-        // std::cin >> filepath;
-        // std::cout << std::endl << filepath << std::endl;
-
-        // testing filepath comment out before submission
-        filepath = "checkboard.test";
-        // filepath = "scene2b.test";
-        scenefile.open(filepath, std::ios::in);
-        if (scenefile)
-        {
-            std::cout << "File exist" << std::endl;
-            // while (!scenefile.eof())
-            while (!scenefile.eof())
-            {
-                char foo[16];
-                scenefile >> foo;
-                filecontent.push_back(foo);
-            }
-            // filecontent.pop_back();
-            scenefile.close();
-        }
-
-        for (int i = 0; i < filecontent.size(); i++)
-        {
-            std::cout << "File index " << i << ": " << filecontent[i] << std::endl;
-        }
-
-        // Camera Initialization
-        camera.imageWidth = std::stoi(filecontent[0]);
-        camera.imageHeight = std::stoi(filecontent[1]);
-        camera.position = glm::vec3(
-            std::stof(filecontent[2]),
-            std::stof(filecontent[3]),
-            std::stof(filecontent[4]));
-        camera.lookTarget = glm::vec3(
-            std::stof(filecontent[5]),
-            std::stof(filecontent[6]),
-            std::stof(filecontent[7]));
-        camera.globalUp = glm::vec3(
-            std::stof(filecontent[8]),
-            std::stof(filecontent[9]),
-            std::stof(filecontent[10]));
-        camera.fovY = std::stof(filecontent[11]);
-        camera.focalLength = std::stof(filecontent[12]);
-        int maxDepth = std::stoi(filecontent[13]);
-        int numObj = std::stoi(filecontent[14]);
-
-        int startNum = 15;
-        for (int i = 0; i < numObj; i++)
-        {
-            if (filecontent[startNum] == "sphere")
-            {
-                // Sphere Initialization
-                sphere = new Sphere();
-                sphere->center = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    std::stof(filecontent[startNum + 2]),
-                    std::stof(filecontent[startNum + 3]));
-                sphere->radius = std::stof(filecontent[startNum + 4]);
-                sphere->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 5]),
-                    std::stof(filecontent[startNum + 6]),
-                    std::stof(filecontent[startNum + 7]));
-                sphere->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 8]),
-                    std::stof(filecontent[startNum + 9]),
-                    std::stof(filecontent[startNum + 10]));
-                sphere->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]),
-                    std::stof(filecontent[startNum + 13]));
-                sphere->material.shininess = std::stof(filecontent[startNum + 14]);
-
-                startNum += 15;
-                scene.objects.push_back(sphere);
-            }
-            if (filecontent[startNum] == "sphereBounce")
-            {
-                // Sphere Initialization
-                sphere = new Sphere();
-                sphere->center = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    bounceY[animationIndex],
-                    std::stof(filecontent[startNum + 3]));
-                sphere->radius = std::stof(filecontent[startNum + 4]);
-                sphere->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 5]),
-                    std::stof(filecontent[startNum + 6]),
-                    std::stof(filecontent[startNum + 7]));
-                sphere->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 8]),
-                    std::stof(filecontent[startNum + 9]),
-                    std::stof(filecontent[startNum + 10]));
-                sphere->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]),
-                    std::stof(filecontent[startNum + 13]));
-                sphere->material.shininess = std::stof(filecontent[startNum + 14]);
-
-                startNum += 15;
-                scene.objects.push_back(sphere);
-            }
-
-            if (filecontent[startNum] == "tri")
-            {
-                // Triangle Initialization
-                triangle = new Triangle();
-                triangle->A = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    std::stof(filecontent[startNum + 2]),
-                    std::stof(filecontent[startNum + 3]));
-                triangle->B = glm::vec3(
-                    std::stof(filecontent[startNum + 4]),
-                    std::stof(filecontent[startNum + 5]),
-                    std::stof(filecontent[startNum + 6]));
-                triangle->C = glm::vec3(
-                    std::stof(filecontent[startNum + 7]),
-                    std::stof(filecontent[startNum + 8]),
-                    std::stof(filecontent[startNum + 9]));
-                triangle->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 10]),
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]));
-                triangle->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 13]),
-                    std::stof(filecontent[startNum + 14]),
-                    std::stof(filecontent[startNum + 15]));
-                triangle->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 16]),
-                    std::stof(filecontent[startNum + 17]),
-                    std::stof(filecontent[startNum + 18]));
-                triangle->material.shininess = std::stof(filecontent[startNum + 19]);
-                startNum += 20;
-                scene.objects.push_back(triangle);
-            }
-            if (filecontent[startNum] == "triSide1")
-            {
-                // Triangle Initialization
-                triangle = new Triangle();
-                triangle->A = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    std::stof(filecontent[startNum + 2]),
-                    std::stof(filecontent[startNum + 3]));
-                triangle->B = glm::vec3(
-                    pyramidSide1BX[animationIndex],
-                    std::stof(filecontent[startNum + 5]),
-                    pyramidSide1BZ[animationIndex]);
-                triangle->C = glm::vec3(
-                    pyramidSide1CX[animationIndex],
-                    std::stof(filecontent[startNum + 8]),
-                    pyramidSide1CZ[animationIndex]);
-                triangle->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 10]),
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]));
-                triangle->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 13]),
-                    std::stof(filecontent[startNum + 14]),
-                    std::stof(filecontent[startNum + 15]));
-                triangle->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 16]),
-                    std::stof(filecontent[startNum + 17]),
-                    std::stof(filecontent[startNum + 18]));
-                triangle->material.shininess = std::stof(filecontent[startNum + 19]);
-                startNum += 20;
-                scene.objects.push_back(triangle);
-            }
-            if (filecontent[startNum] == "triSide2")
-            {
-                // Triangle Initialization
-                triangle = new Triangle();
-                triangle->A = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    std::stof(filecontent[startNum + 2]),
-                    std::stof(filecontent[startNum + 3]));
-                triangle->B = glm::vec3(
-                    pyramidSide2BX[animationIndex],
-                    std::stof(filecontent[startNum + 5]),
-                    pyramidSide2BZ[animationIndex]);
-                triangle->C = glm::vec3(
-                    pyramidSide2CX[animationIndex],
-                    std::stof(filecontent[startNum + 8]),
-                    pyramidSide2CZ[animationIndex]);
-                triangle->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 10]),
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]));
-                triangle->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 13]),
-                    std::stof(filecontent[startNum + 14]),
-                    std::stof(filecontent[startNum + 15]));
-                triangle->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 16]),
-                    std::stof(filecontent[startNum + 17]),
-                    std::stof(filecontent[startNum + 18]));
-                triangle->material.shininess = std::stof(filecontent[startNum + 19]);
-                startNum += 20;
-                scene.objects.push_back(triangle);
-            }
-            if (filecontent[startNum] == "triSide3")
-            {
-                // Triangle Initialization
-                triangle = new Triangle();
-                triangle->A = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    std::stof(filecontent[startNum + 2]),
-                    std::stof(filecontent[startNum + 3]));
-                triangle->B = glm::vec3(
-                    pyramidSide3BX[animationIndex],
-                    std::stof(filecontent[startNum + 5]),
-                    pyramidSide3BZ[animationIndex]);
-                triangle->C = glm::vec3(
-                    pyramidSide3CX[animationIndex],
-                    std::stof(filecontent[startNum + 8]),
-                    pyramidSide3CZ[animationIndex]);
-                triangle->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 10]),
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]));
-                triangle->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 13]),
-                    std::stof(filecontent[startNum + 14]),
-                    std::stof(filecontent[startNum + 15]));
-                triangle->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 16]),
-                    std::stof(filecontent[startNum + 17]),
-                    std::stof(filecontent[startNum + 18]));
-                triangle->material.shininess = std::stof(filecontent[startNum + 19]);
-                startNum += 20;
-                scene.objects.push_back(triangle);
-            }
-            if (filecontent[startNum] == "triSide4")
-            {
-                // Triangle Initialization
-                triangle = new Triangle();
-                triangle->A = glm::vec3(
-                    std::stof(filecontent[startNum + 1]),
-                    std::stof(filecontent[startNum + 2]),
-                    std::stof(filecontent[startNum + 3]));
-                triangle->B = glm::vec3(
-                    pyramidSide4BX[animationIndex],
-                    std::stof(filecontent[startNum + 5]),
-                    pyramidSide4BZ[animationIndex]);
-                triangle->C = glm::vec3(
-                    pyramidSide4CX[animationIndex],
-                    std::stof(filecontent[startNum + 8]),
-                    pyramidSide4CZ[animationIndex]);
-                triangle->material.ambient = glm::vec3(
-                    std::stof(filecontent[startNum + 10]),
-                    std::stof(filecontent[startNum + 11]),
-                    std::stof(filecontent[startNum + 12]));
-                triangle->material.diffuse = glm::vec3(
-                    std::stof(filecontent[startNum + 13]),
-                    std::stof(filecontent[startNum + 14]),
-                    std::stof(filecontent[startNum + 15]));
-                triangle->material.specular = glm::vec3(
-                    std::stof(filecontent[startNum + 16]),
-                    std::stof(filecontent[startNum + 17]),
-                    std::stof(filecontent[startNum + 18]));
-                triangle->material.shininess = std::stof(filecontent[startNum + 19]);
-                startNum += 20;
-                scene.objects.push_back(triangle);
-            }
-        }
-
-        // Light Initialization
-        int lightNum = std::stoi(filecontent[startNum]);
-        std::cout << "Start num: " << startNum << std::endl;
-        std::cout << "Light w: " << std::stof(filecontent[startNum + 4]) << std::endl;
-        for (int i = 0; i < lightNum; i++)
-        {
-            Light light;
-
-            light.position = glm::vec4(
-                std::stof(filecontent[startNum + 1]),  // x
-                std::stof(filecontent[startNum + 2]),  // y
-                std::stof(filecontent[startNum + 3]),  // z
-                std::stof(filecontent[startNum + 4])); // w
-            light.ambient = glm::vec3(
-                std::stof(filecontent[startNum + 5]),  // r
-                std::stof(filecontent[startNum + 6]),  // g
-                std::stof(filecontent[startNum + 7])); // b
-            light.diffuse = glm::vec3(
-                std::stof(filecontent[startNum + 8]),   // r
-                std::stof(filecontent[startNum + 9]),   // g
-                std::stof(filecontent[startNum + 10])); // b
-            light.specular = glm::vec3(
-                std::stof(filecontent[startNum + 11]),  // r
-                std::stof(filecontent[startNum + 12]),  // g
-                std::stof(filecontent[startNum + 13])); // b
-            light.constant = std::stof(filecontent[startNum + 14]);
-            light.linear = std::stof(filecontent[startNum + 15]);
-            light.quadratic = std::stof(filecontent[startNum + 16]);
-
-            startNum += 16;
-            scene.lights.push_back(light);
-        }
-
-        Image image(camera.imageWidth, camera.imageHeight);
-        for (int y = 0; y < image.height; ++y)
-        {
-            for (int x = 0; x < image.width; ++x)
-            {
-                Ray ray = GetRayThruPixel(camera, x, image.height - y - 1);
-
-                glm::vec3 color = RayTrace(ray, scene, camera, maxDepth);
-                image.SetColor(x, y, color);
-            }
-
-            std::cout << "Row: " << std::setfill(' ') << std::setw(4) << (y + 1) << " / " << std::setfill(' ') << std::setw(4) << image.height << "\r" << std::flush;
-        }
-        std::cout << std::endl;
-
-        std::string imageFileName = "frame" + std::to_string(animationIndex) + ".png"; // You might need to make this a full path if you are on Mac
-        stbi_write_png(imageFileName.c_str(), image.width, image.height, 3, image.data.data(), 0);
-
-        for (size_t i = 0; i < scene.objects.size(); ++i)
-        {
-            delete scene.objects[i];
-        }
-    }
-    return 0;
+        std::cout << "Could not write " << writer.failedFiles[i] << std::endl;
+    }
+    return writer.failedFiles.empty() ? 0 : 1;
 }